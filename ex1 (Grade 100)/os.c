@@ -4,8 +4,11 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <pthread.h>
 
 #include "os.h"
 
@@ -13,13 +16,64 @@
 #define NPAGES	(1024*1024)
 
 static char* pages[NPAGES];
+static uint64_t nalloc;
+
+/* frames given back by free_page_frame, handed out again before new ones */
+static uint64_t free_frames[NPAGES];
+static uint64_t nfree;
+
+/*
+ * Frames come either from one mmap each ("mmap", the original scheme) or from
+ * a single region reserved for all NPAGES frames up front ("arena", the
+ * default), where frame n is simply at arena + n * 4096. "thp" asks for
+ * transparent huge pages on the arena and "hugetlb" backs it with
+ * MAP_HUGETLB pages, falling back to "thp" when none are reserved.
+ * The mode is taken from OS_FRAME_ALLOCATOR at the first allocation.
+ */
+static char* arena;
+static int allocator_ready;
+
+static void init_allocator(void)
+{
+	const char* mode = getenv("OS_FRAME_ALLOCATOR");
+	size_t size = (size_t)NPAGES * 4096;
+	int flags = MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE;
+	void* va = MAP_FAILED;
+
+	allocator_ready = 1;
+	if (mode == NULL)
+		mode = "arena";
+
+	if (strcmp(mode, "mmap") == 0)
+		return;
+	if (strcmp(mode, "arena") != 0 && strcmp(mode, "thp") != 0 && strcmp(mode, "hugetlb") != 0)
+		errx(1, "unknown OS_FRAME_ALLOCATOR %s", mode);
+
+	/* huge pages are reserved at mmap time (without MAP_NORESERVE), so a
+	 * shortage fails here instead of faulting on first touch */
+	if (strcmp(mode, "hugetlb") == 0)
+		va = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	if (va == MAP_FAILED) {
+		va = mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
+		if (va == MAP_FAILED)
+			return; /* can't reserve the region, one mmap per frame still works */
+		if (strcmp(mode, "arena") != 0)
+			madvise(va, size, MADV_HUGEPAGE);
+	}
+	arena = va;
+}
 
 uint64_t alloc_page_frame(void)
 {
-	static uint64_t nalloc;
 	uint64_t ppn;
 	void* va;
 
+	if (!allocator_ready)
+		init_allocator();
+
+	if (nfree > 0)
+		return free_frames[--nfree];
+
 	if (nalloc == NPAGES)
 		errx(1, "out of physical memory");
 
@@ -27,6 +81,9 @@ uint64_t alloc_page_frame(void)
 	ppn = nalloc;
 	nalloc++;
 
+	if (arena != NULL)
+		return ppn; /* untouched arena memory is already zero */
+
 	va = mmap(NULL, 4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
 	if (va == MAP_FAILED)
 		err(1, "mmap failed");
@@ -35,23 +92,145 @@ uint64_t alloc_page_frame(void)
 	return ppn;
 }
 
+void free_page_frame(uint64_t ppn)
+{
+	if (ppn >= nalloc)
+		errx(1, "freeing a frame that was never allocated");
+
+	/* frames must come out of alloc_page_frame zeroed, like fresh mmap memory */
+	memset(phys_to_virt(ppn << 12), 0, 4096);
+	free_frames[nfree++] = ppn;
+}
+
+uint64_t page_frames_in_use(void)
+{
+	return nalloc - nfree;
+}
+
 void* phys_to_virt(uint64_t phys_addr)
 {
 	uint64_t ppn = phys_addr >> 12;
 	uint64_t off = phys_addr & 0xfff;
 	char* va = NULL;
 
-	if (ppn < NPAGES)
-		va = pages[ppn] + off;
+	if (ppn >= NPAGES)
+		return NULL;
+
+	if (arena != NULL)
+		return arena + phys_addr;
+
+	va = pages[ppn] + off;
 
 	return va;
 }
 
+#ifndef PT_BENCH /* the tests below, pt_bench.c brings its own main instead */
+
+/* the numbered tests spell out entry indices, vpns and node counts of the
+ * default geometry, other geometries run the geometry test instead */
+#define DEFAULT_GEOMETRY	(PT_LEVELS == 5 && PT_LEVEL_BITS == 9)
+
+#if DEFAULT_GEOMETRY
+
+/* concurrency stress test: writers map and unmap pages in disjoint vpn
+ * ranges that share upper levels, readers query all of them meanwhile */
+#define STRESS_WRITERS	2
+#define STRESS_READERS	4
+#define STRESS_ROUNDS	5000
+#define STRESS_BASE	0x3000000ULL
+
+static uint64_t stress_pt;
+static int stress_done;
+
+static uint64_t stress_random(uint64_t* state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* the only ppn vpn is ever mapped to, so readers can check what they see */
+static uint64_t stress_ppn(uint64_t vpn)
+{
+	return vpn ^ 0x5a5a5;
+}
+
+static uint64_t stress_vpn(int writer, uint64_t r)
+{
+	return STRESS_BASE + (r % 8) * 0x40000 + writer * 1024 + (r >> 3) % 1024;
+}
+
+static void* stress_writer(void* arg)
+{
+	int writer = (int)(intptr_t)arg;
+	uint64_t state = 0x9e3779b97f4a7c15ULL * (writer + 1);
+	uint64_t vpns[8];
+
+	for (int round = 0; round < STRESS_ROUNDS; round++) {
+		for (int i = 0; i < 8; i++) {
+			vpns[i] = stress_vpn(writer, stress_random(&state));
+			page_table_update_concurrent(stress_pt, vpns[i], stress_ppn(vpns[i]));
+		}
+		for (int i = 0; i < 8; i++)
+			assert(page_table_query_concurrent(stress_pt, vpns[i]) == stress_ppn(vpns[i]));
+		for (int i = 0; i < 8; i++)
+			page_table_update_concurrent(stress_pt, vpns[i], NO_MAPPING);
+		for (int i = 0; i < 8; i++)
+			assert(page_table_query_concurrent(stress_pt, vpns[i]) == NO_MAPPING);
+	}
+	return NULL;
+}
+
+static void* stress_reader(void* arg)
+{
+	uint64_t state = 0x2545f4914f6cdd1dULL * ((intptr_t)arg + 1);
+
+	while (!__atomic_load_n(&stress_done, __ATOMIC_ACQUIRE)) {
+		uint64_t r = stress_random(&state);
+		uint64_t vpn = stress_vpn(r % STRESS_WRITERS, r >> 1);
+		uint64_t ppn = page_table_query_concurrent(stress_pt, vpn);
+		assert(ppn == NO_MAPPING || ppn == stress_ppn(vpn));
+	}
+	return NULL;
+}
+
+/* page_table_walk_ranges callback of the 14th test, copies the runs it gets */
+static int collect_run(void* arg, uint64_t vpn, uint64_t ppn, uint64_t count)
+{
+	uint64_t* runs = arg;
+	uint64_t* run = &runs[1 + 3 * runs[0]++];
+
+	run[0] = vpn;
+	run[1] = ppn;
+	run[2] = count;
+	return runs[0] == 4;
+}
+
+/* page_table_scan_accessed callback of the 16th test, copies the runs it gets */
+static int collect_scan(void* arg, uint64_t vpn, uint64_t count, int flags)
+{
+	uint64_t* runs = arg;
+	uint64_t* run = &runs[1 + 3 * runs[0]++];
+
+	run[0] = vpn;
+	run[1] = count;
+	run[2] = flags;
+	return runs[0] == 4;
+}
+
+/* page_table_scan_accessed callback of the 16th test, counts the pages it gets */
+static int count_scan(void* arg, uint64_t vpn, uint64_t count, int flags)
+{
+	*(uint64_t*)arg += count;
+	return 0;
+}
+#endif
+
 int main(int argc, char **argv)
 {
 	uint64_t pt = alloc_page_frame();
 	uint64_t new_pt = alloc_page_frame();
-	uint64_t *tmp;
 	
 	/* 1st Test */
 	assert(page_table_query(pt, 0xcafe) == NO_MAPPING);
@@ -98,7 +277,9 @@ int main(int argc, char **argv)
 	assert(page_table_query(new_pt, 0xcafe) == NO_MAPPING);
 	printf("5th Test: PASSED\n");
 	
+#if DEFAULT_GEOMETRY
 	/* 6th Test */
+	uint64_t *tmp;
 	page_table_update(pt, 0x1ffff8000000, 0x1212);
 	assert(page_table_query(pt, 0x1ffff8000000) == 0x1212);
 	tmp = phys_to_virt(pt << 12);
@@ -108,7 +289,276 @@ int main(int argc, char **argv)
 	tmp = phys_to_virt((tmp[0] >> 12) << 12);
 	tmp[0] = ((tmp[0] >> 1) << 1);
 	assert(page_table_query(pt, 0x1ffff8000000) == NO_MAPPING);
-	printf("6th Test: PASSED\n\n----------------\n");
+	printf("6th Test: PASSED\n");
+	
+	/* 7th Test */
+	uint64_t ppns[1500];
+	page_table_update_range(new_pt, 0x7fff0, 1500, 0x4000);
+	assert(page_table_query(new_pt, 0x7fff0) == 0x4000);
+	assert(page_table_query(new_pt, 0x7fff0 + 1499) == 0x4000 + 1499);
+	assert(page_table_query(new_pt, 0x7fff0 + 1500) == NO_MAPPING);
+	assert(page_table_query_range(new_pt, 0x7fff0 - 10, 1500, ppns) == 1490);
+	assert(ppns[9] == NO_MAPPING && ppns[10] == 0x4000 && ppns[1499] == 0x4000 + 1489);
+	page_table_update_range(new_pt, 0x7fff0 + 100, 1000, NO_MAPPING);
+	assert(page_table_query(new_pt, 0x7fff0 + 99) == 0x4000 + 99);
+	assert(page_table_query(new_pt, 0x7fff0 + 100) == NO_MAPPING);
+	assert(page_table_query(new_pt, 0x7fff0 + 1100) == 0x4000 + 1100);
+	page_table_update_range(new_pt, 0, 0x7fff0 + 1500, NO_MAPPING);
+	assert(page_table_query_range(new_pt, 0x7fff0, 1500, ppns) == 0);
+	assert(page_table_query_range(new_pt, 0x1ffffffffff0, 16, ppns) == 0);
+	printf("7th Test: PASSED\n");
+	
+	/* 8th Test */
+	uint64_t hits, misses;
+	assert(page_table_tlb_configure(3, 4) == -1);
+	assert(page_table_tlb_configure(16, 4) == 0);
+	page_table_update(pt, 0xcafe, 0xf00d);
+	page_table_update(new_pt, 0xcafe, 0xbeef);
+	assert(page_table_query(pt, 0xcafe) == 0xf00d);
+	assert(page_table_query(pt, 0xcafe) == 0xf00d);
+	assert(page_table_query(new_pt, 0xcafe) == 0xbeef);
+	page_table_tlb_stats(&hits, &misses);
+	assert(hits == 1 && misses == 2);
+	page_table_update(pt, 0xcafe, 0xd00d);
+	assert(page_table_query(pt, 0xcafe) == 0xd00d);
+	page_table_update(pt, 0xcafe, NO_MAPPING);
+	assert(page_table_query(pt, 0xcafe) == NO_MAPPING);
+	assert(page_table_query(new_pt, 0xcafe) == 0xbeef);
+	page_table_update_range(new_pt, 0xca00, 0x100, NO_MAPPING);
+	assert(page_table_query(new_pt, 0xcafe) == NO_MAPPING);
+	assert(page_table_tlb_configure(0, 0) == 0);
+	printf("8th Test: PASSED\n");
+	
+	/* 9th Test */
+	uint64_t level_hits[5], level_misses[5];
+	assert(page_table_walk_cache_configure(64) == 0);
+	page_table_update(pt, 0x1234500, 0x77);
+	page_table_update(pt, 0x1234501, 0x78);
+	page_table_update(pt, 0x1234600, 0x79);
+	assert(page_table_query(pt, 0x1234500) == 0x77);
+	assert(page_table_query(pt, 0x1234501) == 0x78);
+	assert(page_table_query(pt, 0x1234600) == 0x79);
+	assert(page_table_query(new_pt, 0x1234500) == NO_MAPPING);
+	page_table_walk_cache_stats(level_hits, level_misses);
+	assert(level_hits[4] == 4 && level_hits[3] == 1);
+	page_table_update(pt, 0x1234500, NO_MAPPING);
+	page_table_update(pt, 0x1234501, NO_MAPPING);
+	page_table_update(pt, 0x1234600, NO_MAPPING);
+	assert(page_table_query(pt, 0x1234501) == NO_MAPPING);
+	assert(page_table_walk_cache_configure(0) == 0);
+	printf("9th Test: PASSED\n");
+	
+	/* 10th Test */
+	assert(page_table_update_huge(pt, 0x40000, 0x80000, HUGE_PAGES_2M) == 0);
+	assert(page_table_update_huge(pt, 0x40001, 0x80000, HUGE_PAGES_2M) == -1);
+	assert(page_table_update_huge(pt, 0x40000, 0x80000, 1000) == -1);
+	assert(page_table_query(pt, 0x40000) == 0x80000);
+	assert(page_table_query(pt, 0x401ff) == 0x801ff);
+	page_table_update(pt, 0x40007, 0x1);
+	assert(page_table_query(pt, 0x40006) == 0x80006);
+	assert(page_table_query(pt, 0x40007) == 0x1);
+	page_table_update(pt, 0x40007, 0x80007);
+	tmp = phys_to_virt(pt << 12);
+	tmp = phys_to_virt((tmp[0] >> 12) << 12);
+	tmp = phys_to_virt((tmp[0] >> 12) << 12);
+	tmp = phys_to_virt((tmp[1] >> 12) << 12);
+	assert(tmp[0] == ((0x80000ULL << 12) | 3));
+	page_table_update_range(new_pt, 0x80000, HUGE_PAGES_1G + 5, 0x200000);
+	assert(page_table_query(new_pt, 0x80000 + 0x12345) == 0x200000 + 0x12345);
+	assert(page_table_query(new_pt, 0x80000 + HUGE_PAGES_1G + 4) == 0x200000 + HUGE_PAGES_1G + 4);
+	assert(page_table_query_range(new_pt, 0x80000 + HUGE_PAGES_1G - 2, 10, ppns) == 7);
+	assert(ppns[0] == 0x200000 + HUGE_PAGES_1G - 2 && ppns[6] == 0x200000 + HUGE_PAGES_1G + 4 && ppns[7] == NO_MAPPING);
+	page_table_update(new_pt, 0x80000 + 0x12345, NO_MAPPING);
+	assert(page_table_query(new_pt, 0x80000 + 0x12345) == NO_MAPPING);
+	assert(page_table_query(new_pt, 0x80000 + 0x12346) == 0x200000 + 0x12346);
+	assert(page_table_update_huge(new_pt, 0x80000, NO_MAPPING, HUGE_PAGES_1G) == 0);
+	assert(page_table_query(new_pt, 0x80000 + 0x12346) == NO_MAPPING);
+	page_table_update_range(new_pt, 0x80000, HUGE_PAGES_1G + 5, NO_MAPPING);
+	assert(page_table_update_huge(pt, 0x40000, NO_MAPPING, HUGE_PAGES_2M) == 0);
+	assert(page_table_query(pt, 0x40007) == NO_MAPPING);
+	printf("10th Test: PASSED\n");
+	
+	/* 11th Test */
+	uint64_t nodes[5];
+	uint64_t in_use = page_frames_in_use();
+	assert(page_table_footprint(new_pt, nodes) == 4096);
+	page_table_update(new_pt, 0x123456789, 0x42);
+	assert(page_table_footprint(new_pt, nodes) == 5 * 4096);
+	assert(nodes[0] == 1 && nodes[4] == 1);
+	assert(page_frames_in_use() == in_use + 4);
+	page_table_update_range(new_pt, 0x123456000, 3000, 0x1000);
+	page_table_update(new_pt, 0x123456789, NO_MAPPING);
+	page_table_update_range(new_pt, 0x123456000, 3000, NO_MAPPING);
+	assert(page_table_footprint(new_pt, nodes) == 4096);
+	assert(page_frames_in_use() == in_use);
+	page_table_update_range(new_pt, 0x123400000, 1024, 0x5000);
+	assert(page_table_footprint(new_pt, nodes) == 4 * 4096 && nodes[3] == 1 && nodes[4] == 0);
+	page_table_update(new_pt, 0x123400005, 0x7);
+	assert(nodes[4] == 0 && page_table_footprint(new_pt, nodes) == 5 * 4096 && nodes[4] == 1);
+	page_table_update(new_pt, 0x123400005, 0x5005);
+	assert(page_table_footprint(new_pt, nodes) == 4 * 4096);
+	page_table_update_range(new_pt, 0x123400000, 1024, NO_MAPPING);
+	assert(page_frames_in_use() == in_use);
+	printf("11th Test: PASSED\n");
+	
+	/* 12th Test */
+	pthread_t writers[STRESS_WRITERS], readers[STRESS_READERS];
+	stress_pt = alloc_page_frame();
+	for (intptr_t i = 0; i < STRESS_READERS; i++)
+		assert(pthread_create(&readers[i], NULL, stress_reader, (void*)i) == 0);
+	for (intptr_t i = 0; i < STRESS_WRITERS; i++)
+		assert(pthread_create(&writers[i], NULL, stress_writer, (void*)i) == 0);
+	for (int i = 0; i < STRESS_WRITERS; i++)
+		pthread_join(writers[i], NULL);
+	__atomic_store_n(&stress_done, 1, __ATOMIC_RELEASE);
+	for (int i = 0; i < STRESS_READERS; i++)
+		pthread_join(readers[i], NULL);
+	assert(page_table_footprint(stress_pt, nodes) == 4096);
+	printf("12th Test: PASSED\n");
+
+	/* 13th Test */
+	uint64_t parent = alloc_page_frame();
+	in_use = page_frames_in_use();
+	page_table_update_range(parent, 0x4000000, 1000, 0x100);
+	page_table_update(parent, 0x123456789, 0x42);
+	uint64_t shared = page_frames_in_use();
+	uint64_t child = page_table_clone(parent);
+	assert(page_frames_in_use() == shared + 1);
+	assert(page_table_query(child, 0x4000010) == 0x110);
+	assert(page_table_query(child, 0x123456789) == 0x42);
+	page_table_update(child, 0x4000010, 0x77);
+	assert(page_frames_in_use() == shared + 5);
+	assert(page_table_query(child, 0x4000010) == 0x77);
+	assert(page_table_query(parent, 0x4000010) == 0x110);
+	page_table_update(parent, 0x123456789, NO_MAPPING);
+	assert(page_table_query(parent, 0x123456789) == NO_MAPPING);
+	assert(page_table_query(child, 0x123456789) == 0x42);
+	page_table_destroy(parent);
+	assert(page_table_query(child, 0x4000020) == 0x120);
+	page_table_destroy(child);
+	assert(page_frames_in_use() == in_use - 1);
+	printf("13th Test: PASSED\n");
+
+	/* 14th Test */
+	uint64_t saved = alloc_page_frame();
+	uint64_t runs[1 + 3 * 4] = { 0 };
+	char snapshot[] = "/tmp/pt_snapshot_XXXXXX";
+	page_table_update_range(saved, 0x4000000, 1000, 0x100);
+	page_table_update_range(saved, 0x4000000 + 1000, 24, 0x100 + 1000);
+	page_table_update_huge(saved, 0x4000400, 0x800, HUGE_PAGES_2M);
+	page_table_update(saved, 0x123456789, 0x42);
+	page_table_update(saved, 0x12345678a, 0x7);
+	assert(page_table_walk_ranges(saved, collect_run, runs) == 4);
+	assert(runs[1] == 0x4000000 && runs[2] == 0x100 && runs[3] == 1024);
+	assert(runs[4] == 0x4000400 && runs[5] == 0x800 && runs[6] == 512);
+	assert(runs[7] == 0x123456789 && runs[8] == 0x42 && runs[9] == 1);
+	assert(runs[10] == 0x12345678a && runs[11] == 0x7 && runs[12] == 1);
+	int snapshot_fd = mkstemp(snapshot);
+	assert(snapshot_fd >= 0);
+	close(snapshot_fd);
+	assert(page_table_save(saved, snapshot) == 0);
+	uint64_t loaded = page_table_load(snapshot);
+	assert(loaded != NO_MAPPING);
+	assert(page_table_query(loaded, 0x4000010) == 0x110);
+	assert(page_table_query(loaded, 0x40005ff) == 0x9ff);
+	assert(page_table_query(loaded, 0x4000600) == NO_MAPPING);
+	assert(page_table_query(loaded, 0x12345678a) == 0x7);
+	assert(page_table_footprint(loaded, nodes) == page_table_footprint(saved, nodes));
+	unlink(snapshot);
+	assert(page_table_load(snapshot) == NO_MAPPING);
+	page_table_destroy(saved);
+	page_table_destroy(loaded);
+	printf("14th Test: PASSED\n");
+
+	/* 15th Test */
+	uint64_t batch_vpns[100], batch_ppns[100];
+	page_table_update_range(new_pt, 0x5000000, 40, 0x900);
+	page_table_update_huge(new_pt, 0x5040000, 0x80000, HUGE_PAGES_1G);
+	for (int i = 0; i < 100; i++)
+		batch_vpns[i] = i % 3 == 0 ? 0x5000000 + i : i % 3 == 1 ? 0x5040000 + i * 0x101 : 0x7000000 + i;
+	assert(page_table_query_batch(new_pt, batch_vpns, 100, batch_ppns) == 14 + 33);
+	for (int i = 0; i < 100; i++)
+		assert(batch_ppns[i] == page_table_query(new_pt, batch_vpns[i]));
+	assert(page_table_query_batch(new_pt, batch_vpns, 0, batch_ppns) == 0);
+	page_table_update_range(new_pt, 0x5000000, 40, NO_MAPPING);
+	page_table_update_huge(new_pt, 0x5040000, NO_MAPPING, HUGE_PAGES_1G);
+	printf("15th Test: PASSED\n");
+
+	/* 16th Test */
+	uint64_t scanned[1 + 3 * 4];
+	assert(page_table_tlb_configure(16, 4) == 0);
+	page_table_update_range(new_pt, 0x6000000, 64, 0x300);
+	page_table_update(new_pt, 0x6200000, 0x55);
+	assert(page_table_access(new_pt, 0x6000005, 0) == 0x305);
+	assert(page_table_access(new_pt, 0x6000006, 1) == 0x306);
+	assert(page_table_access(new_pt, 0x6000007, 0) == 0x307);
+	assert(page_table_access(new_pt, 0x6000100, 0) == NO_MAPPING);
+	scanned[0] = 0;
+	assert(page_table_scan_accessed(new_pt, 1, 0, collect_scan, scanned) == 3);
+	assert(scanned[1] == 0x6000005 && scanned[2] == 1 && scanned[3] == PAGE_ACCESSED);
+	assert(scanned[4] == 0x6000006 && scanned[6] == (PAGE_ACCESSED | PAGE_DIRTY));
+	assert(scanned[7] == 0x6000007 && scanned[9] == PAGE_ACCESSED);
+	scanned[0] = 0;
+	assert(page_table_scan_accessed(new_pt, 0, PAGE_ACCESSED, collect_scan, scanned) == 3);
+	assert(scanned[1] == 0x6000000 && scanned[2] == 5 && scanned[3] == 0);
+	assert(scanned[4] == 0x6000008 && scanned[5] == 56);
+	assert(scanned[7] == 0x6200000 && scanned[8] == 1);
+	scanned[0] = 0;
+	assert(page_table_scan_accessed(new_pt, 1, 0, collect_scan, scanned) == 0);
+	assert(page_table_scan_accessed(new_pt, 0, 0, collect_scan, scanned) == 4);
+	assert(scanned[4] == 0x6000006 && scanned[5] == 1 && scanned[6] == PAGE_DIRTY);
+	assert(page_table_access(new_pt, 0x6000007, 0) == 0x307); /* the scan dropped the cached translation */
+	scanned[0] = 0;
+	assert(page_table_scan_accessed(new_pt, 1, PAGE_ACCESSED | PAGE_DIRTY, collect_scan, scanned) == 1);
+	assert(scanned[1] == 0x6000007 && scanned[3] == PAGE_ACCESSED);
+	assert(page_table_scan_accessed(new_pt, 1, 0, collect_scan, scanned) == 0);
+	uint64_t clone = page_table_clone(new_pt), pages = 0;
+	assert(page_table_access(new_pt, 0x6000010, 0) == 0x310);
+	page_table_scan_accessed(clone, 0, PAGE_ACCESSED, count_scan, &pages);
+	assert(pages == 64);
+	assert(page_table_access(new_pt, 0x6000010, 0) == 0x310); /* the shared leaf lost A, so new_pt walks again */
+	pages = 0;
+	assert(page_table_scan_accessed(new_pt, 1, 0, count_scan, &pages) == 1 && pages == 1);
+	page_table_destroy(clone);
+	assert(page_table_tlb_configure(0, 0) == 0);
+	page_table_update_range(new_pt, 0x6000000, 64, NO_MAPPING);
+	page_table_update(new_pt, 0x6200000, NO_MAPPING);
+	assert(page_table_footprint(new_pt, nodes) == 4096);
+	printf("16th Test: PASSED\n\n----------------\n");
+#else
+	/* Geometry Test */
+	uint64_t nodes[PT_LEVELS];
+	uint64_t in_use = page_frames_in_use();
+	uint64_t top = 1ULL << PT_VPN_BITS;
+	/* the first and last root entries, so the two paths split at the root even with 1 bit levels */
+	page_table_update(new_pt, top - 1, 0x1212);
+	page_table_update(new_pt, 1, 0x3434);
+	assert(page_table_query(new_pt, top - 1) == 0x1212);
+	assert(page_table_query(new_pt, 1) == 0x3434);
+	assert(page_table_query(new_pt, top - 2) == NO_MAPPING);
+	assert(page_table_footprint(new_pt, nodes) == (2 * PT_LEVELS - 1) * 4096 && nodes[PT_LEVELS - 1] == 2);
+	uint64_t child = page_table_clone(new_pt);
+	page_table_update(child, top - 1, 0x5656);
+	assert(page_table_query(new_pt, top - 1) == 0x1212);
+	assert(page_table_query(child, top - 1) == 0x5656);
+	page_table_destroy(child);
+	page_table_update(new_pt, top - 1, NO_MAPPING);
+	page_table_update(new_pt, 1, NO_MAPPING);
+	/* a range that fits even the smallest address spaces, cloned while its nodes may be huge entries */
+	uint64_t range = 3 * HUGE_PAGES_2M < top ? 3 * HUGE_PAGES_2M : top;
+	page_table_update_range(new_pt, 0, range, 0x7000);
+	assert(page_table_query(new_pt, range - 1) == 0x7000 + range - 1);
+	child = page_table_clone(new_pt);
+	page_table_update(child, 0, 0x5656);
+	assert(page_table_query(new_pt, 0) == 0x7000);
+	assert(page_table_query(child, 0) == 0x5656);
+	assert(page_table_query(child, range - 1) == 0x7000 + range - 1);
+	page_table_destroy(child);
+	page_table_update_range(new_pt, 0, range, NO_MAPPING);
+	assert(page_table_footprint(new_pt, nodes) == 4096);
+	assert(page_frames_in_use() == in_use);
+	printf("Geometry Test (%d levels of %d bits): PASSED\n\n----------------\n", PT_LEVELS, PT_LEVEL_BITS);
+#endif
 	
 	printf("Overall:  PASSED\n\n");
 	
@@ -116,4 +566,4 @@ int main(int argc, char **argv)
 	
 	return 0;
 }
-
+#endif
@@ -3,10 +3,113 @@
 
 #define NO_MAPPING	(~0ULL)
 
+/* radix geometry of the page table, fixed at compile time: PT_LEVELS levels
+ * each indexed by PT_LEVEL_BITS bits of the vpn (e.g. -DPT_LEVELS=4 for
+ * x86-64 4-level paging). a node of 2^PT_LEVEL_BITS entries must fit in a
+ * single frame, so PT_LEVEL_BITS is at most 9 */
+#ifndef PT_LEVELS
+#define PT_LEVELS	5
+#endif
+#ifndef PT_LEVEL_BITS
+#define PT_LEVEL_BITS	9
+#endif
+#define PT_VPN_BITS	(PT_LEVELS * PT_LEVEL_BITS)
+
 uint64_t alloc_page_frame(void);
+void free_page_frame(uint64_t ppn);
+uint64_t page_frames_in_use(void);
 void* phys_to_virt(uint64_t phys_addr);
 
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
+/* map count pages starting at vpn_start to consecutive ppns starting at
+ * ppn_start (or unmap them if ppn_start is NO_MAPPING) */
+void page_table_update_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t ppn_start);
+/* fill ppns[i] with the translation of vpn_start + i, returns how many are mapped */
+uint64_t page_table_query_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t *ppns);
+/* fill ppns[i] with the translation of vpns[i], returns how many are mapped.
+ * the walks of the batch are interleaved and each one prefetches the entry it
+ * reads next, so the misses of unrelated vpns overlap. bypasses the TLB and
+ * the walk cache */
+uint64_t page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t count, uint64_t *ppns);
+
+/* pages mapped by a single huge entry of the last two upper levels that have
+ * them (2 MB and 1 GB with 4 KB pages and the default geometry) */
+#define HUGE_PAGES_2M	(1ULL << PT_LEVEL_BITS)
+#define HUGE_PAGES_1G	(1ULL << 2 * PT_LEVEL_BITS)
+
+/* map npages (HUGE_PAGES_2M or HUGE_PAGES_1G) pages from vpn to ppn with a
+ * single upper level entry (or unmap them if ppn is NO_MAPPING). vpn and ppn
+ * must be aligned to npages. returns 0 on success, -1 otherwise.
+ * page_table_update_range uses huge entries for aligned parts by itself, and
+ * nodes that become fully contiguous are promoted to huge entries */
+int page_table_update_huge(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t npages);
+
+/* count the nodes of pt (its root included) per level into nodes_per_level
+ * and return the memory they take in bytes. nodes left empty by unmapping are
+ * released, so this follows the mapped set */
+uint64_t page_table_footprint(uint64_t pt, uint64_t nodes_per_level[PT_LEVELS]);
+
+/* fork: return a new page table with the same mappings as pt. the two share
+ * every node below their roots, a shared node is copied for a table on its
+ * first update through it, so cloning takes constant time */
+uint64_t page_table_clone(uint64_t pt);
+/* release pt and the nodes no other table shares */
+void page_table_destroy(uint64_t pt);
+
+/* call fn for every maximal run of count consecutive vpns from vpn mapped to
+ * consecutive ppns from ppn, in increasing vpn order. unmapped subtrees are
+ * skipped whole, so this costs about the number of mapped nodes. stops early
+ * once fn returns nonzero. returns the number of runs fn was called for */
+uint64_t page_table_walk_ranges(uint64_t pt, int (*fn)(void *arg, uint64_t vpn, uint64_t ppn, uint64_t count), void *arg);
+/* write the mappings of pt to the file at path as a run length encoded
+ * snapshot: a header of a magic number and the run count, followed by the
+ * {vpn, ppn, count} runs of page_table_walk_ranges. returns 0 on success, -1
+ * otherwise */
+int page_table_save(uint64_t pt, const char *path);
+/* mmap a snapshot written by page_table_save and rebuild it in a new page
+ * table, one page_table_update_range per run. returns the new table, or
+ * NO_MAPPING if the file can't be read or isn't a snapshot */
+uint64_t page_table_load(const char *path);
+
+/* translate vpn like page_table_query, and mark it accessed (and dirty if
+ * write is nonzero) in pt, the way an MMU does on a memory access */
+uint64_t page_table_access(uint64_t pt, uint64_t vpn, int write);
+/* accessed and dirty state of the pages reported by page_table_scan_accessed */
+#define PAGE_ACCESSED	1
+#define PAGE_DIRTY	2
+/* call fn for every maximal run of count mapped pages from vpn sharing the
+ * same flags, in increasing vpn order: the accessed ones if hot is nonzero,
+ * the others otherwise. unmapped subtrees are skipped, and a hot scan skips
+ * subtrees nothing was accessed in since they were last cleared. clear
+ * (PAGE_ACCESSED and/or PAGE_DIRTY) is cleared on every page the scan passes,
+ * so a scan with clear = PAGE_ACCESSED starts the next aging period. stops
+ * early once fn returns nonzero. returns the number of runs fn was called for.
+ * tables sharing nodes after page_table_clone share these bits as well, but
+ * not those of the upper entries each table has its own copy of: a hot scan
+ * of one table may skip pages only the other table accessed */
+uint64_t page_table_scan_accessed(uint64_t pt, int hot, int clear, int (*fn)(void *arg, uint64_t vpn, uint64_t count, int flags), void *arg);
+
+/* thread safe query and update: any number of threads may query while others
+ * update, queries never block. nodes emptied by unmapping are freed once no
+ * query can still be reading them. these bypass the TLB, the walk cache and
+ * huge page promotion, mustn't be used on cloned tables and mustn't run
+ * together with the other updates */
+uint64_t page_table_query_concurrent(uint64_t pt, uint64_t vpn);
+void page_table_update_concurrent(uint64_t pt, uint64_t vpn, uint64_t ppn);
+
+/* software TLB in front of page_table_query, off by default. sets must be a
+ * power of 2, 0 sets and 0 ways turn it off. returns 0 on success, -1 otherwise */
+int page_table_tlb_configure(uint64_t sets, uint64_t ways);
+void page_table_tlb_flush(void);
+void page_table_tlb_stats(uint64_t *hits, uint64_t *misses);
+
+/* page walk cache of the nodes below the root, off by default. entries_per_level
+ * must be a power of 2, 0 turns it off. returns 0 on success, -1 otherwise.
+ * the stats are indexed by level (1 to PT_LEVELS - 1), a walk looks levels up deepest first */
+int page_table_walk_cache_configure(uint64_t entries_per_level);
+void page_table_walk_cache_flush(void);
+void page_table_walk_cache_stats(uint64_t hits[PT_LEVELS], uint64_t misses[PT_LEVELS]);
+
 
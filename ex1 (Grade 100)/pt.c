@@ -1,85 +1,1666 @@
+#define _POSIX_C_SOURCE 200809L // for the pthread rwlock
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "os.h"
 
+#if PT_LEVEL_BITS < 1 || PT_LEVEL_BITS > 9
+#error "a node of 2^PT_LEVEL_BITS entries has to fit in a single 4 KB frame"
+#endif
+#if PT_LEVELS < 2 || PT_VPN_BITS > 52
+#error "the page table needs at least 2 levels, and vpns of at most 52 bits to fit ppns in the entries"
+#endif
+
+// the geometry is fixed at compile time (see PT_LEVELS in os.h), so every shift and mask below is a constant and the
+// walks over the levels are unrolled
+#define LEVEL_ENTRIES (1 << PT_LEVEL_BITS) // number of entries in each level of the page table
+#define LAST_LEVEL (PT_LEVELS - 1) // index of the level whose entries hold the mapped ppns
+#define HUGE_MIN_LEVEL (LAST_LEVEL > 2 ? LAST_LEVEL - 2 : 1) // highest level whose entries may map their whole span
+	// (1 GB at level 2 and 2 MB at level 3 with the default geometry)
+
+#define PT_STRINGIFY(x) #x
+#define PT_PRAGMA(x) _Pragma(PT_STRINGIFY(x))
+#define UNROLL_LEVELS PT_PRAGMA(GCC unroll PT_LEVELS) // fully unroll the loop that follows over the levels
+
+#define PTE_VALID 1ULL
+#define PTE_HUGE 2ULL // entry of an upper level mapping its whole span directly (like the x86 PS bit)
+#define PTE_ACCESSED 4ULL // set by page_table_access on every entry of the walk. clear on an upper entry means
+	// nothing below it was accessed since the last scan that cleared it
+#define PTE_DIRTY 8ULL // set by page_table_access on the entry mapping a page that was written
+#define PTE_AD_SHIFT 2 // PTE_ACCESSED and PTE_DIRTY are PAGE_ACCESSED and PAGE_DIRTY shifted by this much
+#define PTE_ADDR_MASK (~0xFFFULL)
+
+// modes of get_level
+#define WALK_LOOKUP 0 // stop at the first invalid or huge entry
+#define WALK_SPLIT 1 // stop at the first invalid entry, split huge entries on the way
+#define WALK_ALLOC 2 // add missing levels and split huge entries on the way
+
+#define BATCH_LANES 16 // walks page_table_query_batch keeps in flight, enough to cover the latency of a miss
+
+#define SNAPSHOT_MAGIC 0x31304e5350414d50ULL // "PMAPSN01" in the first 8 bytes of a snapshot file
+
+#define META_CHUNK_FRAMES 4096 // node metadata is allocated for this many frames at a time
+#define META_CHUNKS 4096 // enough chunks for 2^24 frames
+
 uint64_t get_vpn_part(uint64_t vpn, int part_index)
 {
-	int bit_offset = 9 * (4 - part_index); // offset of lsb of current part. part 0 goes back the most, part 4 is in the front.
-	uint64_t bitmask = 0x1FFULL << bit_offset; // mask to get 9 bits for current part
+	int bit_offset = PT_LEVEL_BITS * (LAST_LEVEL - part_index); // offset of lsb of current part. part 0 goes back the most, the last part is in the front.
+	uint64_t bitmask = (LEVEL_ENTRIES - 1ULL) << bit_offset; // mask to get PT_LEVEL_BITS bits for current part
 	return (vpn & bitmask) >> bit_offset;
 }
 
-void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+// software TLB caching translations in front of page_table_query. it is set associative with LRU replacement in
+// each set, and entries are tagged with the pt they belong to (its root ppn serves as the ASID), so translations of
+// different page tables can live in it together. disabled until page_table_tlb_configure is called
+struct tlb_entry
 {
-	uint64_t cur_level_phys_addr = pt << 12;
+	uint64_t pt;
+	uint64_t vpn;
+	uint64_t ppn;
+	uint64_t flags; // PTE_ACCESSED and PTE_DIRTY as known to be set in the table, so page_table_access may skip the walk
+	uint64_t last_used; // clock value of the last hit, 0 marks an empty entry
+};
 
-	for (int i = 0; i < 4; ++i)
+static struct
+{
+	struct tlb_entry* entries; // sets * ways entries, the ways of each set are adjacent
+	uint64_t sets;
+	uint64_t ways;
+	uint64_t clock;
+	uint64_t hits;
+	uint64_t misses;
+} tlb;
+
+int page_table_tlb_configure(uint64_t sets, uint64_t ways)
+{
+	if ((sets & (sets - 1)) != 0 || (sets == 0) != (ways == 0)) // sets must be a power of 2, both 0 disable the TLB
 	{
-		uint64_t cur_vpn_part = get_vpn_part(vpn, i);
-		uint64_t* cur_level_ptr = (uint64_t*) phys_to_virt(cur_level_phys_addr);
-		uint64_t cur_pte = cur_level_ptr[cur_vpn_part];
-		uint64_t valid = cur_pte & 1;
+		return -1;
+	}
 
-		uint64_t next_addr;
-		if (valid)
+	struct tlb_entry* entries = NULL;
+	if (sets != 0)
+	{
+		entries = calloc(sets * ways, sizeof(struct tlb_entry));
+		if (entries == NULL)
 		{
-			next_addr = cur_pte & ~1;
+			return -1;
 		}
-		else
+	}
+
+	free(tlb.entries);
+	tlb.entries = entries;
+	tlb.sets = sets;
+	tlb.ways = ways;
+	tlb.clock = 0;
+	tlb.hits = 0;
+	tlb.misses = 0;
+	return 0;
+}
+
+void page_table_tlb_stats(uint64_t *hits, uint64_t *misses)
+{
+	*hits = tlb.hits;
+	*misses = tlb.misses;
+}
+
+void page_table_tlb_flush(void)
+{
+	for (uint64_t i = 0; i < tlb.sets * tlb.ways; i++)
+	{
+		tlb.entries[i].last_used = 0;
+	}
+}
+
+// the ways of the set that may hold the translation of vpn in pt
+struct tlb_entry* tlb_set(uint64_t pt, uint64_t vpn)
+{
+	uint64_t set = (vpn ^ (pt * 0x9E3779B97F4A7C15ULL >> 32)) & (tlb.sets - 1); // mix the ASID in so tables don't collide
+	return &tlb.entries[set * tlb.ways];
+}
+
+// returns the cached entry of vpn in pt or NULL if it isn't cached
+struct tlb_entry* tlb_lookup(uint64_t pt, uint64_t vpn)
+{
+	struct tlb_entry* set = tlb_set(pt, vpn);
+
+	for (uint64_t way = 0; way < tlb.ways; way++)
+	{
+		if (set[way].last_used != 0 && set[way].vpn == vpn && set[way].pt == pt)
+		{
+			return &set[way];
+		}
+	}
+	return NULL;
+}
+
+void tlb_insert(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t flags)
+{
+	struct tlb_entry* set = tlb_set(pt, vpn);
+	struct tlb_entry* victim = &set[0];
+
+	for (uint64_t way = 1; way < tlb.ways && victim->last_used != 0; way++) // empty entry or least recently used one
+	{
+		if (set[way].last_used < victim->last_used)
+		{
+			victim = &set[way];
+		}
+	}
+
+	victim->pt = pt;
+	victim->vpn = vpn;
+	victim->ppn = ppn;
+	victim->flags = flags;
+	victim->last_used = ++tlb.clock;
+}
+
+void tlb_invalidate_range(uint64_t pt, uint64_t vpn_start, uint64_t count)
+{
+	if (tlb.sets == 0)
+	{
+		return;
+	}
+
+	if (count <= tlb.sets) // drop each vpn from its set
+	{
+		for (uint64_t vpn = vpn_start; vpn < vpn_start + count; vpn++)
 		{
-			if (ppn == NO_MAPPING) // we were asked to invalidate an entry which is already invalid so nothing needs to be done
+			struct tlb_entry* entry = tlb_lookup(pt, vpn);
+			if (entry != NULL)
 			{
-				return;
+				entry->last_used = 0;
 			}
+		}
+		return;
+	}
+
+	// large ranges are cheaper to handle by going over the whole TLB once
+	for (uint64_t i = 0; i < tlb.sets * tlb.ways; i++)
+	{
+		struct tlb_entry* entry = &tlb.entries[i];
+		if (entry->pt == pt && entry->vpn - vpn_start < count)
+		{
+			entry->last_used = 0;
+		}
+	}
+}
+
+// paging-structure (page walk) cache. for each level below the root it remembers the physical address of the node
+// reached for a (pt, vpn prefix), so a walk can skip the upper levels and start at the deepest cached one. each level
+// has its own direct mapped cache. disabled until page_table_walk_cache_configure is called
+struct pwc_entry
+{
+	uint64_t pt;
+	uint64_t prefix; // the vpn bits that select the node, vpn >> (PT_LEVEL_BITS * (LAST_LEVEL + 1 - level))
+	uint64_t node_phys_addr;
+	int valid;
+};
+
+static struct
+{
+	struct pwc_entry* entries[LAST_LEVEL + 1]; // entries[level] for levels 1 to LAST_LEVEL
+	uint64_t size; // entries per level
+	uint64_t hits[LAST_LEVEL + 1];
+	uint64_t misses[LAST_LEVEL + 1];
+} pwc;
+
+int page_table_walk_cache_configure(uint64_t entries_per_level)
+{
+	if ((entries_per_level & (entries_per_level - 1)) != 0) // must be a power of 2, 0 disables the cache
+	{
+		return -1;
+	}
 
-			else // if we are adding a new mapping and reached invalid before the end we need to add levels
+	struct pwc_entry* entries[LAST_LEVEL + 1] = {NULL};
+	for (int level = 1; level <= LAST_LEVEL && entries_per_level != 0; level++)
+	{
+		entries[level] = calloc(entries_per_level, sizeof(struct pwc_entry));
+		if (entries[level] == NULL)
+		{
+			for (int i = 1; i < level; i++)
 			{
-				next_addr = alloc_page_frame() << 12;
-				cur_level_ptr[cur_vpn_part] = next_addr | 1;
+				free(entries[i]);
 			}
+			return -1;
 		}
+	}
 
-		cur_level_phys_addr = next_addr;
+	for (int level = 1; level <= LAST_LEVEL; level++)
+	{
+		free(pwc.entries[level]);
+		pwc.entries[level] = entries[level];
+		pwc.hits[level] = 0;
+		pwc.misses[level] = 0;
 	}
+	pwc.size = entries_per_level;
+	return 0;
+}
 
-	uint64_t* last_level_ptr = (uint64_t*) phys_to_virt(cur_level_phys_addr);
-	uint64_t last_vpn_part = get_vpn_part(vpn, 4);
-	if (ppn == NO_MAPPING)
+void page_table_walk_cache_stats(uint64_t hits[PT_LEVELS], uint64_t misses[PT_LEVELS])
+{
+	for (int level = 0; level <= LAST_LEVEL; level++)
 	{
-		last_level_ptr[last_vpn_part] = 0; // invalidate entry
+		hits[level] = pwc.hits[level];
+		misses[level] = pwc.misses[level];
 	}
-	else
+}
+
+void page_table_walk_cache_flush(void)
+{
+	for (int level = 1; level <= LAST_LEVEL && pwc.size != 0; level++)
 	{
-		last_level_ptr[last_vpn_part] = (ppn << 12) | 1; // set entry to ppn with the valid bit on
+		for (uint64_t i = 0; i < pwc.size; i++)
+		{
+			pwc.entries[level][i].valid = 0;
+		}
 	}
 }
 
-uint64_t page_table_query(uint64_t pt, uint64_t vpn)
+// the vpn prefix selecting the node of level level on the walk of vpn
+uint64_t pwc_prefix(uint64_t vpn, int level)
 {
-	uint64_t cur_level_phys_addr = pt << 12;
+	return vpn >> (PT_LEVEL_BITS * (LAST_LEVEL + 1 - level));
+}
+
+struct pwc_entry* pwc_slot(uint64_t pt, uint64_t prefix, int level)
+{
+	uint64_t index = (prefix ^ (pt * 0x9E3779B97F4A7C15ULL >> 32)) & (pwc.size - 1);
+	return &pwc.entries[level][index];
+}
+
+// find the deepest level on the walk of vpn in pt whose node is cached. returns its index and sets *level_phys_addr
+// to the node's physical address, or returns 0 (the root) when nothing is cached
+int pwc_lookup(uint64_t pt, uint64_t vpn, uint64_t *level_phys_addr)
+{
+	*level_phys_addr = pt << 12;
+	if (pwc.size == 0)
+	{
+		return 0;
+	}
+
+	for (int level = LAST_LEVEL; level > 0; level--)
+	{
+		uint64_t prefix = pwc_prefix(vpn, level);
+		struct pwc_entry* entry = pwc_slot(pt, prefix, level);
+
+		if (entry->valid && entry->prefix == prefix && entry->pt == pt)
+		{
+			pwc.hits[level]++;
+			*level_phys_addr = entry->node_phys_addr;
+			return level;
+		}
+		pwc.misses[level]++;
+	}
+	return 0;
+}
+
+// remember that the node of level level on the walk of vpn in pt is at node_phys_addr
+void pwc_insert(uint64_t pt, uint64_t vpn, int level, uint64_t node_phys_addr)
+{
+	if (pwc.size == 0)
+	{
+		return;
+	}
+
+	struct pwc_entry* entry = pwc_slot(pt, pwc_prefix(vpn, level), level);
+	entry->pt = pt;
+	entry->prefix = pwc_prefix(vpn, level);
+	entry->node_phys_addr = node_phys_addr;
+	entry->valid = 1;
+}
+
+// forget the cached nodes of levels level and below on the way to vpn in pt, after the entry linking the node of
+// level level was changed. the prefixes below that node are an aligned block, and so are the slots they index
+// (pwc_slot only xors the prefix with a constant), so only that block of each level is looked at, not the whole cache
+void pwc_invalidate(uint64_t pt, uint64_t vpn, int level)
+{
+	for (int cur_level = level > 0 ? level : 1; cur_level <= LAST_LEVEL && pwc.size != 0; cur_level++)
+	{
+		int shift = PT_LEVEL_BITS * (cur_level - level);
+		uint64_t first_prefix = pwc_prefix(vpn, level) << shift;
+		uint64_t count = 1ULL << shift; // prefixes of this level below the changed entry
+		uint64_t first = 0;
+
+		if (count < pwc.size)
+		{
+			first = (uint64_t)(pwc_slot(pt, first_prefix, cur_level) - pwc.entries[cur_level]) & ~(count - 1);
+		}
+		else
+		{
+			count = pwc.size;
+		}
+
+		for (uint64_t i = first; i < first + count; i++)
+		{
+			struct pwc_entry* entry = &pwc.entries[cur_level][i];
+			if (entry->pt == pt && entry->prefix >> shift == pwc_prefix(vpn, level))
+			{
+				entry->valid = 0;
+			}
+		}
+	}
+}
 
-	for (int i = 0; i < 5; ++i)
+// number of vpns covered by a single entry of level level_index
+uint64_t level_span(int level_index)
+{
+	return 1ULL << (PT_LEVEL_BITS * (LAST_LEVEL - level_index));
+}
+
+// bookkeeping of each node, indexed by the node's ppn. it lives in chunks allocated on first use
+struct node_meta
+{
+	uint32_t valid; // number of valid entries
+	uint32_t extra_refs; // number of page tables sharing the node besides the first one (see page_table_clone).
+		// 32 bits, as 16 would wrap after 65535 live clones and free nodes still in use
+	uint8_t cloned; // set on the root of a table that was cloned or is a clone, so it may reach shared nodes
+};
+
+static struct node_meta* node_metas[META_CHUNKS];
+
+struct node_meta* get_node_meta(uint64_t node_phys_addr)
+{
+	uint64_t ppn = node_phys_addr >> 12;
+
+	if (ppn / META_CHUNK_FRAMES >= META_CHUNKS)
+		errx(1, "node frame out of range");
+
+	struct node_meta** chunk = &node_metas[ppn / META_CHUNK_FRAMES];
+	struct node_meta* metas = __atomic_load_n(chunk, __ATOMIC_ACQUIRE);
+	if (metas == NULL)
+	{
+		struct node_meta* new_metas = calloc(META_CHUNK_FRAMES, sizeof(struct node_meta));
+		if (new_metas == NULL)
+			errx(1, "out of memory for node metadata");
+
+		// the concurrent updates may race to add the same chunk, the loser drops its copy
+		if (__atomic_compare_exchange_n(chunk, &metas, new_metas, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			metas = new_metas;
+		}
+		else
+		{
+			free(new_metas);
+		}
+	}
+	return &metas[ppn % META_CHUNK_FRAMES];
+}
+
+// the valid entry count of the node at node_phys_addr
+uint32_t* valid_count(uint64_t node_phys_addr)
+{
+	return &get_node_meta(node_phys_addr)->valid;
+}
+
+// store pte in entry index of the node at node_phys_addr, keeping the node's valid entry count
+void set_pte(uint64_t node_phys_addr, uint64_t index, uint64_t pte)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+
+	*valid_count(node_phys_addr) += (int) (pte & PTE_VALID) - (int) (node[index] & PTE_VALID);
+	node[index] = pte;
+}
+
+// give the frame of the node at node_phys_addr back to the frame pool
+void release_node(uint64_t node_phys_addr)
+{
+	struct node_meta* meta = get_node_meta(node_phys_addr);
+
+	meta->valid = 0;
+	meta->cloned = 0; // the frame may be the root of a new table next
+	free_page_frame(node_phys_addr >> 12);
+}
+
+// number of nodes shared by several tables. once it drops back to 0 no table can reach a shared node anymore, and
+// updates of cloned tables may start from the walk cache again
+static uint64_t shared_nodes;
+
+// drop one of the extra references of a shared node
+void unshare_node(struct node_meta* meta)
+{
+	shared_nodes -= --meta->extra_refs == 0;
+}
+
+// drop one reference to the node at node_phys_addr of level level_index. once no page table refers to it anymore it
+// is released together with every node below it
+void free_subtree(uint64_t node_phys_addr, int level_index)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+	struct node_meta* meta = get_node_meta(node_phys_addr);
+
+	if (meta->extra_refs > 0) // still used by another table
+	{
+		unshare_node(meta);
+		return;
+	}
+
+	for (int i = 0; i < LEVEL_ENTRIES && level_index < LAST_LEVEL; i++)
+	{
+		if ((node[i] & PTE_VALID) && !(node[i] & PTE_HUGE))
+		{
+			free_subtree(node[i] & PTE_ADDR_MASK, level_index + 1);
+		}
+	}
+	release_node(node_phys_addr);
+}
+
+// replace the huge entry index of level level_index in the node at node_phys_addr by a node of the next level
+// mapping the same span. returns the new entry
+uint64_t split_huge(uint64_t node_phys_addr, uint64_t index, int level_index)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+	uint64_t next_addr = alloc_page_frame() << 12;
+	uint64_t* next_level_ptr = (uint64_t*) phys_to_virt(next_addr);
+	uint64_t ppn = node[index] >> 12;
+	uint64_t step = level_span(level_index + 1);
+	uint64_t flags = level_index + 1 == LAST_LEVEL ? PTE_VALID : PTE_VALID | PTE_HUGE;
+
+	flags |= node[index] & (PTE_ACCESSED | PTE_DIRTY); // the pages keep the state of the huge page they were part of
+	for (int i = 0; i < LEVEL_ENTRIES; i++)
+	{
+		next_level_ptr[i] = ((ppn + i * step) << 12) | flags;
+	}
+	*valid_count(next_addr) = LEVEL_ENTRIES;
+	node[index] = next_addr | PTE_VALID | (node[index] & PTE_ACCESSED); // valid before and after, the count of node doesn't change
+	return node[index];
+}
+
+// add a reference to each node linked by the entries of node, a node of level level_index
+void share_children(uint64_t* node, int level_index)
+{
+	for (int i = 0; i < LEVEL_ENTRIES && level_index < LAST_LEVEL; i++)
+	{
+		if ((node[i] & PTE_VALID) && !(node[i] & PTE_HUGE))
+		{
+			struct node_meta* meta = get_node_meta(node[i] & PTE_ADDR_MASK);
+			shared_nodes += meta->extra_refs++ == 0;
+		}
+	}
+}
+
+// give pt a private copy of the shared node linked by entry index of the node at node_phys_addr, a node of level
+// level_index. the children of the node become shared between the copy and the original. returns the new entry
+uint64_t copy_shared(uint64_t pt, uint64_t vpn, uint64_t node_phys_addr, uint64_t index, int level_index)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+	uint64_t shared_addr = node[index] & PTE_ADDR_MASK;
+	uint64_t copy_addr = alloc_page_frame() << 12;
+	uint64_t* copy_ptr = (uint64_t*) phys_to_virt(copy_addr);
+	uint64_t* shared_ptr = (uint64_t*) phys_to_virt(shared_addr);
+
+	for (int i = 0; i < LEVEL_ENTRIES; i++)
+	{
+		copy_ptr[i] = shared_ptr[i];
+	}
+	share_children(copy_ptr, level_index + 1);
+	*valid_count(copy_addr) = *valid_count(shared_addr);
+	unshare_node(get_node_meta(shared_addr));
+
+	node[index] = (node[index] & ~PTE_ADDR_MASK) | copy_addr; // valid before and after, the count doesn't change
+	pwc_invalidate(pt, vpn, level_index + 1); // pt reaches other nodes below this entry now
+	return node[index];
+}
+
+uint64_t page_table_clone(uint64_t pt)
+{
+	uint64_t clone = alloc_page_frame();
+	uint64_t* src_ptr = (uint64_t*) phys_to_virt(pt << 12);
+	uint64_t* dst_ptr = (uint64_t*) phys_to_virt(clone << 12);
+
+	// only the root is copied, every node below it is shared until one of the tables writes to it
+	for (int i = 0; i < LEVEL_ENTRIES; i++)
+	{
+		dst_ptr[i] = src_ptr[i];
+	}
+	share_children(dst_ptr, 0);
+	*valid_count(clone << 12) = *valid_count(pt << 12);
+	get_node_meta(pt << 12)->cloned = 1;
+	get_node_meta(clone << 12)->cloned = 1;
+	return clone;
+}
+
+void page_table_destroy(uint64_t pt)
+{
+	tlb_invalidate_range(pt, 0, NO_MAPPING);
+	pwc_invalidate(pt, 0, 0);
+	free_subtree(pt << 12, 0);
+}
+
+// walk from the root of pt to the node of level target_level covering vpn, according to mode (see WALK_*).
+// returns the physical address of the node. when the walk stops early it returns NO_MAPPING and sets *stop_level
+// (if not NULL) to the index of the level holding the entry it stopped at, and *stop_pte (if not NULL) to that entry
+uint64_t get_level(uint64_t pt, uint64_t vpn, int target_level, int mode, int *stop_level, uint64_t *stop_pte)
+{
+	uint64_t cur_level_phys_addr;
+	int i = pwc_lookup(pt, vpn, &cur_level_phys_addr);
+
+	// the cache skipped past the target, or may hold a node shared with another table (updates must copy those
+	// on the way down, so they need the whole path): walk from the root
+	if (i > target_level || (mode != WALK_LOOKUP && shared_nodes > 0 && get_node_meta(pt << 12)->cloned))
+	{
+		i = 0;
+		cur_level_phys_addr = pt << 12;
+	}
+
+	// cached nodes are invalidated whenever the entry linking them changes, so the walk can resume from them
+	for (; i < target_level; ++i)
 	{
 		uint64_t cur_vpn_part = get_vpn_part(vpn, i);
+		uint64_t cur_pte = ((uint64_t*) phys_to_virt(cur_level_phys_addr))[cur_vpn_part];
 
-		uint64_t* cur_level_ptr = (uint64_t*) phys_to_virt(cur_level_phys_addr);
-		uint64_t cur_pte = cur_level_ptr[cur_vpn_part];
-		uint64_t valid = cur_pte & 1;
+		if (!(cur_pte & PTE_VALID) && mode == WALK_ALLOC) // if we are adding a new mapping and reached invalid before the end we need to add levels
+		{
+			cur_pte = (alloc_page_frame() << 12) | PTE_VALID;
+			set_pte(cur_level_phys_addr, cur_vpn_part, cur_pte);
+		}
+		else if ((cur_pte & PTE_HUGE) && mode != WALK_LOOKUP) // a single page inside the huge mapping is changed
+		{
+			cur_pte = split_huge(cur_level_phys_addr, cur_vpn_part, i);
+		}
 
-		if (!valid)
+		if (!(cur_pte & PTE_VALID) || (cur_pte & PTE_HUGE))
 		{
+			if (stop_level != NULL)
+			{
+				*stop_level = i;
+			}
+			if (stop_pte != NULL)
+			{
+				*stop_pte = cur_pte;
+			}
 			return NO_MAPPING;
 		}
 
-		uint64_t found_addr = cur_pte & ~1; // turn off valid bit
+		// copy on write: a node about to be changed (or passed on the way to one) must belong to pt alone
+		if (mode != WALK_LOOKUP && get_node_meta(cur_pte & PTE_ADDR_MASK)->extra_refs > 0)
+		{
+			cur_pte = copy_shared(pt, vpn, cur_level_phys_addr, cur_vpn_part, i);
+		}
+
+		uint64_t next_addr = cur_pte & PTE_ADDR_MASK;
+		pwc_insert(pt, vpn, i + 1, next_addr);
+		cur_level_phys_addr = next_addr;
+	}
+
+	return cur_level_phys_addr;
+}
+
+// walk from the root of pt to the last level node covering vpn, see get_level
+uint64_t get_last_level(uint64_t pt, uint64_t vpn, int mode, int *stop_level, uint64_t *stop_pte)
+{
+	return get_level(pt, vpn, LAST_LEVEL, mode, stop_level, stop_pte);
+}
 
-		if (i == 4) // last level - address represents query result
+// fill path[i] with the physical address of the node of level i on the way to vpn in pt. this walks from the root
+// since the callers change the entries linking the nodes, which the walk cache doesn't keep.
+// returns the deepest level reached
+int walk_path(uint64_t pt, uint64_t vpn, uint64_t path[LAST_LEVEL + 1])
+{
+	path[0] = pt << 12;
+
+	for (int i = 0; i < LAST_LEVEL; ++i)
+	{
+		uint64_t cur_pte = ((uint64_t*) phys_to_virt(path[i]))[get_vpn_part(vpn, i)];
+		if (!(cur_pte & PTE_VALID) || (cur_pte & PTE_HUGE))
 		{
-			return found_addr >> 12; // get physical page number
+			return i;
 		}
-		else // on levels 1-4 the found address represents the address of the next level
+		path[i + 1] = cur_pte & PTE_ADDR_MASK;
+	}
+	return LAST_LEVEL;
+}
+
+// after the node of level level_index on the way to vpn lost its last valid entry, release it and each ancestor that
+// becomes empty in turn. the root is never released
+void reclaim_empty(uint64_t pt, uint64_t vpn, int level_index)
+{
+	uint64_t path[LAST_LEVEL + 1] = { 0 }; // only up to depth is set, which some compilers can't tell
+	int depth = walk_path(pt, vpn, path);
+
+	for (int i = level_index; i > 0 && i <= depth && *valid_count(path[i]) == 0; --i)
+	{
+		set_pte(path[i - 1], get_vpn_part(vpn, i - 1), 0);
+		pwc_invalidate(pt, vpn, i);
+		release_node(path[i]);
+	}
+}
+
+// check whether node, a node of level level_index, maps its whole span contiguously from a suitably aligned ppn,
+// so it can be replaced by a single huge entry. returns that huge entry or 0 if it can't
+uint64_t contiguous_entry(uint64_t* node, int level_index)
+{
+	uint64_t step = level_span(level_index);
+	uint64_t flags = level_index == LAST_LEVEL ? PTE_VALID : PTE_VALID | PTE_HUGE;
+	uint64_t first_ppn = node[0] >> 12;
+
+	if (first_ppn % (step * LEVEL_ENTRIES) != 0)
+	{
+		return 0;
+	}
+
+	for (int i = LEVEL_ENTRIES - 1; i >= 0; i--)
+	{
+		if (node[i] != (((first_ppn + i * step) << 12) | flags))
 		{
-			cur_level_phys_addr = found_addr;
+			return 0;
 		}
 	}
+	return (first_ppn << 12) | PTE_VALID | PTE_HUGE;
+}
 
-	return NO_MAPPING; // should never be reached
+// after the last level entry of vpn was mapped, replace the nodes on its way that became fully contiguous by huge
+// entries in their parents, from the last level up to HUGE_MIN_LEVEL
+void try_promote(uint64_t pt, uint64_t vpn)
+{
+	uint64_t path[LAST_LEVEL + 1];
+
+	if (walk_path(pt, vpn, path) < LAST_LEVEL)
+	{
+		return;
+	}
+
+	// only full nodes are worth scanning
+	for (int i = LAST_LEVEL; i > HUGE_MIN_LEVEL && *valid_count(path[i]) == LEVEL_ENTRIES; --i)
+	{
+		uint64_t huge_pte = contiguous_entry((uint64_t*) phys_to_virt(path[i]), i);
+		if (huge_pte == 0)
+		{
+			return;
+		}
+
+		set_pte(path[i - 1], get_vpn_part(vpn, i - 1), huge_pte);
+		pwc_invalidate(pt, vpn, i);
+		release_node(path[i]); // its entries are last level or huge ones, there is nothing below it
+	}
+}
+
+void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+	tlb_invalidate_range(pt, vpn, 1); // the old translation must not be served anymore, whether remapped or unmapped
+
+	// if we were asked to invalidate an entry whose levels are missing it is already invalid so nothing needs to be done
+	uint64_t last_level_phys_addr = get_last_level(pt, vpn, ppn != NO_MAPPING ? WALK_ALLOC : WALK_SPLIT, NULL, NULL);
+	if (last_level_phys_addr == NO_MAPPING)
+	{
+		return;
+	}
+
+	uint64_t last_vpn_part = get_vpn_part(vpn, LAST_LEVEL);
+	if (ppn == NO_MAPPING)
+	{
+		set_pte(last_level_phys_addr, last_vpn_part, 0); // invalidate entry
+		if (*valid_count(last_level_phys_addr) == 0)
+		{
+			reclaim_empty(pt, vpn, LAST_LEVEL);
+		}
+	}
+	else
+	{
+		set_pte(last_level_phys_addr, last_vpn_part, (ppn << 12) | PTE_VALID); // set entry to ppn with the valid bit on
+		if ((ppn - last_vpn_part) % LEVEL_ENTRIES == 0) // the node may now be contiguous from an aligned ppn
+		{
+			try_promote(pt, vpn);
+		}
+	}
+}
+
+// set the entry of level level_index covering vpn to map its whole span from ppn (or clear it for NO_MAPPING),
+// releasing the subtree it linked before
+void set_level_entry(uint64_t pt, uint64_t vpn, int level_index, uint64_t ppn)
+{
+	uint64_t span = level_span(level_index);
+	uint64_t level_phys_addr = get_level(pt, vpn, level_index, ppn != NO_MAPPING ? WALK_ALLOC : WALK_SPLIT, NULL, NULL);
+
+	tlb_invalidate_range(pt, vpn & ~(span - 1), span);
+	if (level_phys_addr == NO_MAPPING) // unmapping a subtree which doesn't exist
+	{
+		return;
+	}
+
+	uint64_t index = get_vpn_part(vpn, level_index);
+	uint64_t old_pte = ((uint64_t*) phys_to_virt(level_phys_addr))[index];
+
+	set_pte(level_phys_addr, index, ppn == NO_MAPPING ? 0 : (ppn << 12) | PTE_VALID | PTE_HUGE);
+	if ((old_pte & PTE_VALID) && !(old_pte & PTE_HUGE)) // nodes cached below the old entry are not reachable anymore
+	{
+		pwc_invalidate(pt, vpn, level_index + 1);
+		free_subtree(old_pte & PTE_ADDR_MASK, level_index + 1);
+	}
+	if (ppn == NO_MAPPING && level_index > 0 && *valid_count(level_phys_addr) == 0)
+	{
+		reclaim_empty(pt, vpn, level_index);
+	}
+}
+
+int page_table_update_huge(uint64_t pt, uint64_t vpn, uint64_t ppn, uint64_t npages)
+{
+	int level_index;
+
+	for (level_index = HUGE_MIN_LEVEL; level_index < LAST_LEVEL; level_index++)
+	{
+		if (level_span(level_index) == npages)
+		{
+			break;
+		}
+	}
+
+	if (level_index == LAST_LEVEL || vpn % npages != 0 || (ppn != NO_MAPPING && ppn % npages != 0))
+	{
+		return -1;
+	}
+
+	set_level_entry(pt, vpn, level_index, ppn);
+	return 0;
+}
+
+// translate vpn through the levels of pt, without the TLB
+uint64_t page_table_walk(uint64_t pt, uint64_t vpn)
+{
+	uint64_t cur_level_phys_addr;
+	int start = pwc_lookup(pt, vpn, &cur_level_phys_addr);
+
+	// the loop runs over all the levels and skips the ones above the walk cache hit, rather than starting at the hit.
+	// its bounds are then constants, so it's unrolled into straight-line steps whose shifts and masks are constants
+	UNROLL_LEVELS
+	for (int i = 0; i <= LAST_LEVEL; ++i)
+	{
+		if (i < start)
+		{
+			continue;
+		}
+
+		uint64_t cur_vpn_part = get_vpn_part(vpn, i);
+
+		uint64_t* cur_level_ptr = (uint64_t*) phys_to_virt(cur_level_phys_addr);
+		uint64_t cur_pte = cur_level_ptr[cur_vpn_part];
+		uint64_t valid = cur_pte & PTE_VALID;
+
+		if (!valid)
+		{
+			return NO_MAPPING;
+		}
+
+		uint64_t found_addr = cur_pte & PTE_ADDR_MASK; // turn off valid bit and flags
+
+		if (cur_pte & PTE_HUGE) // upper level entry mapping its whole span, the rest of the vpn is an offset in it
+		{
+			return (found_addr >> 12) + (vpn & (level_span(i) - 1));
+		}
+		else if (i == LAST_LEVEL) // last level - address represents query result
+		{
+			return found_addr >> 12; // get physical page number
+		}
+		else // on the upper levels the found address represents the address of the next level
+		{
+			pwc_insert(pt, vpn, i + 1, found_addr);
+			cur_level_phys_addr = found_addr;
+		}
+	}
+
+	return NO_MAPPING; // should never be reached
+}
+
+uint64_t page_table_query(uint64_t pt, uint64_t vpn)
+{
+	if (tlb.sets != 0)
+	{
+		struct tlb_entry* entry = tlb_lookup(pt, vpn);
+		if (entry != NULL)
+		{
+			tlb.hits++;
+			entry->last_used = ++tlb.clock;
+			return entry->ppn;
+		}
+
+		tlb.misses++;
+		uint64_t ppn = page_table_walk(pt, vpn);
+		if (ppn != NO_MAPPING) // only valid translations are cached
+		{
+			tlb_insert(pt, vpn, ppn, 0);
+		}
+		return ppn;
+	}
+
+	return page_table_walk(pt, vpn);
+}
+
+uint64_t page_table_access(uint64_t pt, uint64_t vpn, int write)
+{
+	uint64_t needed = write ? PTE_ACCESSED | PTE_DIRTY : PTE_ACCESSED;
+
+	if (tlb.sets != 0)
+	{
+		struct tlb_entry* entry = tlb_lookup(pt, vpn);
+		if (entry != NULL && (entry->flags & needed) == needed) // the bits are set already, like a hardware TLB hit
+		{
+			tlb.hits++;
+			entry->last_used = ++tlb.clock;
+			return entry->ppn;
+		}
+		tlb.misses++;
+	}
+
+	// walk from the root, not the walk cache, as every upper entry on the way has to be marked accessed too
+	uint64_t* cur_pte = (uint64_t*) phys_to_virt(pt << 12) + get_vpn_part(vpn, 0);
+	uint64_t ppn = NO_MAPPING;
+
+	for (int i = 0; i <= LAST_LEVEL && (*cur_pte & PTE_VALID); ++i)
+	{
+		if (i == LAST_LEVEL || (*cur_pte & PTE_HUGE))
+		{
+			*cur_pte |= needed;
+			ppn = (*cur_pte >> 12) + (vpn & (level_span(i) - 1));
+			break;
+		}
+
+		*cur_pte |= PTE_ACCESSED;
+		cur_pte = (uint64_t*) phys_to_virt(*cur_pte & PTE_ADDR_MASK) + get_vpn_part(vpn, i + 1);
+	}
+
+	if (tlb.sets != 0 && ppn != NO_MAPPING)
+	{
+		struct tlb_entry* entry = tlb_lookup(pt, vpn);
+		if (entry != NULL)
+		{
+			entry->flags |= needed;
+			entry->last_used = ++tlb.clock;
+		}
+		else
+		{
+			tlb_insert(pt, vpn, ppn, needed);
+		}
+	}
+	return ppn;
+}
+
+// the range functions walk the upper levels once per last level node, then handle all of its entries in the range
+// with a linear loop, so mapping a large region costs about one store per page
+
+void page_table_update_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t ppn_start)
+{
+	tlb_invalidate_range(pt, vpn_start, count);
+
+	uint64_t vpn = vpn_start;
+	uint64_t vpn_end = vpn_start + count;
+
+	while (vpn < vpn_end)
+	{
+		uint64_t ppn = ppn_start == NO_MAPPING ? NO_MAPPING : ppn_start + (vpn - vpn_start);
+		int level_index = ppn == NO_MAPPING ? 0 : HUGE_MIN_LEVEL;
+
+		// whole aligned spans of an upper level are mapped with a single huge entry (or cleared with it)
+		for (; level_index < LAST_LEVEL; level_index++)
+		{
+			uint64_t span = level_span(level_index);
+			if (vpn % span == 0 && vpn_end - vpn >= span && (ppn == NO_MAPPING || ppn % span == 0))
+			{
+				break;
+			}
+		}
+		if (level_index < LAST_LEVEL)
+		{
+			set_level_entry(pt, vpn, level_index, ppn);
+			vpn += level_span(level_index);
+			continue;
+		}
+
+		int missing_level = 0;
+		uint64_t last_level_phys_addr = get_last_level(pt, vpn, ppn != NO_MAPPING ? WALK_ALLOC : WALK_SPLIT, &missing_level, NULL);
+
+		if (last_level_phys_addr == NO_MAPPING) // unmapping a subtree which doesn't exist, skip all of it
+		{
+			uint64_t span = level_span(missing_level);
+			uint64_t next_vpn = (vpn & ~(span - 1)) + span;
+			if (next_vpn > vpn_end || next_vpn < vpn) // clip to the range (and guard against wrapping at the top)
+			{
+				next_vpn = vpn_end;
+			}
+			vpn = next_vpn;
+			continue;
+		}
+
+		uint64_t* last_level_ptr = (uint64_t*) phys_to_virt(last_level_phys_addr);
+		uint64_t first = get_vpn_part(vpn, LAST_LEVEL);
+		uint64_t last = first + (vpn_end - vpn); // one past the last entry in range, clipped to the end of the node
+		int valid_delta = 0; // change of the node's valid entry count, applied once for the whole loop
+		if (last > LEVEL_ENTRIES)
+		{
+			last = LEVEL_ENTRIES;
+		}
+
+		if (ppn_start == NO_MAPPING)
+		{
+			for (uint64_t i = first; i < last; i++)
+			{
+				valid_delta -= last_level_ptr[i] & PTE_VALID;
+				last_level_ptr[i] = 0; // invalidate entry
+			}
+			*valid_count(last_level_phys_addr) += valid_delta;
+			if (*valid_count(last_level_phys_addr) == 0)
+			{
+				reclaim_empty(pt, vpn, LAST_LEVEL);
+			}
+		}
+		else
+		{
+			uint64_t pte = (ppn << 12) | PTE_VALID;
+			for (uint64_t i = first; i < last; i++)
+			{
+				valid_delta += !(last_level_ptr[i] & PTE_VALID);
+				last_level_ptr[i] = pte;
+				pte += 1ULL << 12; // next ppn
+			}
+			*valid_count(last_level_phys_addr) += valid_delta;
+			if ((ppn - first) % LEVEL_ENTRIES == 0)
+			{
+				try_promote(pt, vpn);
+			}
+		}
+
+		vpn += last - first;
+	}
+}
+
+uint64_t page_table_query_range(uint64_t pt, uint64_t vpn_start, uint64_t count, uint64_t *ppns)
+{
+	uint64_t vpn = vpn_start;
+	uint64_t vpn_end = vpn_start + count;
+	uint64_t mapped = 0;
+
+	while (vpn < vpn_end)
+	{
+		int stop_level = 0;
+		uint64_t stop_pte = 0;
+		uint64_t last_level_phys_addr = get_last_level(pt, vpn, WALK_LOOKUP, &stop_level, &stop_pte);
+		uint64_t* last_level_ptr = (uint64_t*) phys_to_virt(last_level_phys_addr);
+		uint64_t next_vpn;
+
+		if (last_level_phys_addr == NO_MAPPING) // the whole subtree of the entry is either unmapped or mapped by a huge entry
+		{
+			uint64_t span = level_span(stop_level);
+			next_vpn = (vpn & ~(span - 1)) + span;
+			if (next_vpn > vpn_end || next_vpn < vpn) // clip to the range (and guard against wrapping at the top)
+			{
+				next_vpn = vpn_end;
+			}
+			for (; vpn < next_vpn; vpn++)
+			{
+				if (stop_pte & PTE_VALID)
+				{
+					ppns[vpn - vpn_start] = (stop_pte >> 12) + (vpn & (span - 1));
+					mapped++;
+				}
+				else
+				{
+					ppns[vpn - vpn_start] = NO_MAPPING;
+				}
+			}
+			continue;
+		}
+
+		uint64_t first = get_vpn_part(vpn, LAST_LEVEL);
+		uint64_t last = first + (vpn_end - vpn);
+		if (last > LEVEL_ENTRIES)
+		{
+			last = LEVEL_ENTRIES;
+		}
+
+		for (uint64_t i = first; i < last; i++, vpn++)
+		{
+			uint64_t pte = last_level_ptr[i];
+			if (pte & PTE_VALID)
+			{
+				ppns[vpn - vpn_start] = pte >> 12;
+				mapped++;
+			}
+			else
+			{
+				ppns[vpn - vpn_start] = NO_MAPPING;
+			}
+		}
+	}
+
+	return mapped;
+}
+
+// a walk in flight of page_table_query_batch: the entry it reads next was prefetched when it got to its level
+struct batch_lane
+{
+	uint64_t index; // of the vpn in the batch
+	uint64_t vpn;
+	int level;
+	uint64_t* pte; // entry of level level on the walk of vpn
+};
+
+// start the walk of vpns[index] in lane and prefetch the root entry it needs
+void start_lane(struct batch_lane* lane, uint64_t pt, const uint64_t* vpns, uint64_t index)
+{
+	lane->index = index;
+	lane->vpn = vpns[index];
+	lane->level = 0;
+	lane->pte = (uint64_t*) phys_to_virt(pt << 12) + get_vpn_part(lane->vpn, 0);
+	__builtin_prefetch(lane->pte, 0, 0);
+}
+
+uint64_t page_table_query_batch(uint64_t pt, const uint64_t* vpns, uint64_t count, uint64_t* ppns)
+{
+	struct batch_lane lanes[BATCH_LANES];
+	uint64_t next = 0; // next vpn to start
+	uint64_t mapped = 0;
+	int active = 0;
+
+	while (active < BATCH_LANES && next < count)
+	{
+		start_lane(&lanes[active++], pt, vpns, next++);
+	}
+
+	// round robin over the lanes, each step reads one entry (prefetched a full round earlier) and prefetches the next.
+	// a finished lane takes the next vpn, so all lanes stay busy until the batch runs out
+	for (int i = 0; active > 0; i = i + 1 < active ? i + 1 : 0)
+	{
+		struct batch_lane* lane = &lanes[i];
+		uint64_t cur_pte = *lane->pte;
+		uint64_t ppn;
+
+		if (!(cur_pte & PTE_VALID))
+		{
+			ppn = NO_MAPPING;
+		}
+		else if (cur_pte & PTE_HUGE)
+		{
+			ppn = (cur_pte >> 12) + (lane->vpn & (level_span(lane->level) - 1));
+		}
+		else if (lane->level == LAST_LEVEL)
+		{
+			ppn = cur_pte >> 12;
+		}
+		else
+		{
+			lane->level++;
+			lane->pte = (uint64_t*) phys_to_virt(cur_pte & PTE_ADDR_MASK) + get_vpn_part(lane->vpn, lane->level);
+			__builtin_prefetch(lane->pte, 0, 0);
+			continue;
+		}
+
+		ppns[lane->index] = ppn;
+		mapped += ppn != NO_MAPPING;
+		if (next < count)
+		{
+			start_lane(lane, pt, vpns, next++);
+		}
+		else // the last lane takes this one's place, i visits it next
+		{
+			*lane = lanes[--active];
+			i = i > 0 ? i - 1 : active - 1;
+		}
+	}
+	return mapped;
+}
+
+// count the node at node_phys_addr of level level_index and the nodes below it into nodes_per_level
+void count_nodes(uint64_t node_phys_addr, int level_index, uint64_t nodes_per_level[PT_LEVELS])
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+
+	nodes_per_level[level_index]++;
+	for (int i = 0; i < LEVEL_ENTRIES && level_index < LAST_LEVEL; i++)
+	{
+		if ((node[i] & PTE_VALID) && !(node[i] & PTE_HUGE))
+		{
+			count_nodes(node[i] & PTE_ADDR_MASK, level_index + 1, nodes_per_level);
+		}
+	}
+}
+
+uint64_t page_table_footprint(uint64_t pt, uint64_t nodes_per_level[PT_LEVELS])
+{
+	uint64_t nodes = 0;
+
+	for (int i = 0; i <= LAST_LEVEL; i++)
+	{
+		nodes_per_level[i] = 0;
+	}
+	count_nodes(pt << 12, 0, nodes_per_level);
+
+	for (int i = 0; i <= LAST_LEVEL; i++)
+	{
+		nodes += nodes_per_level[i];
+	}
+	return nodes << 12; // each node takes a whole frame, even when its entries need less
+}
+
+// state of page_table_walk_ranges: the run being built, reported once the next mapping doesn't extend it
+struct range_walk
+{
+	int (*fn)(void* arg, uint64_t vpn, uint64_t ppn, uint64_t count);
+	void* arg;
+	uint64_t vpn;
+	uint64_t ppn;
+	uint64_t count; // 0 while there is no pending run
+	uint64_t runs;
+	int stopped;
+};
+
+// report the pending run of walk, if there is one
+void flush_range(struct range_walk* walk)
+{
+	if (walk->count == 0 || walk->stopped)
+	{
+		return;
+	}
+
+	walk->runs++;
+	walk->stopped = walk->fn(walk->arg, walk->vpn, walk->ppn, walk->count);
+	walk->count = 0;
+}
+
+// add the mapping of count pages from vpn to ppn, extending the pending run when it continues it
+void add_range(struct range_walk* walk, uint64_t vpn, uint64_t ppn, uint64_t count)
+{
+	if (walk->count != 0 && walk->vpn + walk->count == vpn && walk->ppn + walk->count == ppn)
+	{
+		walk->count += count;
+		return;
+	}
+
+	flush_range(walk);
+	walk->vpn = vpn;
+	walk->ppn = ppn;
+	walk->count = count;
+}
+
+// feed the mappings below the node at node_phys_addr of level level_index, whose span starts at vpn_base, to walk
+void walk_node_ranges(uint64_t node_phys_addr, int level_index, uint64_t vpn_base, struct range_walk* walk)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+	uint64_t span = level_span(level_index);
+
+	for (int i = 0; i < LEVEL_ENTRIES && !walk->stopped; i++)
+	{
+		if (!(node[i] & PTE_VALID)) // a whole subtree is skipped in one step
+		{
+			continue;
+		}
+
+		uint64_t vpn = vpn_base + i * span;
+		if (level_index == LAST_LEVEL || (node[i] & PTE_HUGE))
+		{
+			add_range(walk, vpn, node[i] >> 12, span);
+		}
+		else
+		{
+			walk_node_ranges(node[i] & PTE_ADDR_MASK, level_index + 1, vpn, walk);
+		}
+	}
+}
+
+uint64_t page_table_walk_ranges(uint64_t pt, int (*fn)(void* arg, uint64_t vpn, uint64_t ppn, uint64_t count), void* arg)
+{
+	struct range_walk walk = { fn, arg, 0, 0, 0, 0, 0 };
+
+	walk_node_ranges(pt << 12, 0, 0, &walk);
+	flush_range(&walk);
+	return walk.runs;
+}
+
+// the file layout of a snapshot: the header is followed by its runs, in increasing vpn order
+struct snapshot_header
+{
+	uint64_t magic;
+	uint64_t nruns;
+};
+
+struct snapshot_run
+{
+	uint64_t vpn;
+	uint64_t ppn;
+	uint64_t count;
+};
+
+// page_table_walk_ranges callback of page_table_save, appends the run to the snapshot file
+int write_run(void* arg, uint64_t vpn, uint64_t ppn, uint64_t count)
+{
+	struct snapshot_run run = { vpn, ppn, count };
+	return fwrite(&run, sizeof(run), 1, (FILE*) arg) != 1;
+}
+
+int page_table_save(uint64_t pt, const char* path)
+{
+	FILE* file = fopen(path, "wb");
+	struct snapshot_header header = { SNAPSHOT_MAGIC, 0 };
+
+	if (file == NULL)
+	{
+		return -1;
+	}
+
+	// the run count is only known after the walk, so the header is written again at the end
+	int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+	if (!failed)
+	{
+		header.nruns = page_table_walk_ranges(pt, write_run, file);
+		failed = ferror(file) || fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1;
+	}
+
+	if (fclose(file) != 0 || failed)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+uint64_t page_table_load(const char* path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+	{
+		return NO_MAPPING;
+	}
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct snapshot_header))
+	{
+		close(fd);
+		return NO_MAPPING;
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); // the mapping stays valid without the descriptor
+	if (map == MAP_FAILED)
+	{
+		return NO_MAPPING;
+	}
+
+	struct snapshot_header* header = (struct snapshot_header*) map;
+	struct snapshot_run* runs = (struct snapshot_run*) (header + 1);
+	uint64_t pt = NO_MAPPING;
+
+	if (header->magic == SNAPSHOT_MAGIC &&
+		header->nruns == (st.st_size - sizeof(*header)) / sizeof(*runs) &&
+		(st.st_size - sizeof(*header)) % sizeof(*runs) == 0)
+	{
+		// each run is mapped at once, so its aligned parts become huge entries right away
+		pt = alloc_page_frame();
+		for (uint64_t i = 0; i < header->nruns; i++)
+		{
+			page_table_update_range(pt, runs[i].vpn, runs[i].count, runs[i].ppn);
+		}
+	}
+
+	munmap(map, st.st_size);
+	return pt;
+}
+
+// state of page_table_scan_accessed: the run being built, reported once the next page doesn't extend it
+struct access_scan
+{
+	int (*fn)(void* arg, uint64_t vpn, uint64_t count, int flags);
+	void* arg;
+	int hot;
+	uint64_t clear; // PTE_ACCESSED and PTE_DIRTY to clear on every visited entry
+	uint64_t pt;
+	uint64_t vpn;
+	uint64_t count; // 0 while there is no pending run
+	int flags;
+	uint64_t runs;
+	int stopped;
+	int flush_all; // a shared node lost a bit, the tables sharing it have cached translations of it too
+};
+
+// report the pending run of scan, if there is one
+void flush_scan(struct access_scan* scan)
+{
+	if (scan->count == 0 || scan->stopped)
+	{
+		return;
+	}
+
+	scan->runs++;
+	scan->stopped = scan->fn(scan->arg, scan->vpn, scan->count, scan->flags);
+	scan->count = 0;
+}
+
+// add count pages from vpn in the state flags to scan, extending the pending run when it continues it
+void add_scanned(struct access_scan* scan, uint64_t vpn, uint64_t count, int flags)
+{
+	if (scan->count != 0 && scan->vpn + scan->count == vpn && scan->flags == flags)
+	{
+		scan->count += count;
+		return;
+	}
+
+	flush_scan(scan);
+	scan->vpn = vpn;
+	scan->count = count;
+	scan->flags = flags;
+}
+
+// scan the entries below the node at node_phys_addr of level level_index, whose span starts at vpn_base.
+// shared is nonzero when another table reaches the node too, through it or one of its ancestors
+void scan_node(uint64_t node_phys_addr, int level_index, uint64_t vpn_base, int shared, struct access_scan* scan)
+{
+	uint64_t* node = (uint64_t*) phys_to_virt(node_phys_addr);
+	uint64_t span = level_span(level_index);
+	int cleared = 0; // whether a page mapped by this node lost a bit, so its cached translations must go
+
+	for (int i = 0; i < LEVEL_ENTRIES && !scan->stopped; i++)
+	{
+		// invalid subtrees are skipped whole, and so are unaccessed ones when only hot pages are wanted
+		if (!(node[i] & PTE_VALID) || (scan->hot && !(node[i] & PTE_ACCESSED)))
+		{
+			continue;
+		}
+
+		uint64_t vpn = vpn_base + i * span;
+		if (level_index == LAST_LEVEL || (node[i] & PTE_HUGE))
+		{
+			int flags = (node[i] & (PTE_ACCESSED | PTE_DIRTY)) >> PTE_AD_SHIFT;
+			if (scan->hot == !!(flags & PAGE_ACCESSED))
+			{
+				add_scanned(scan, vpn, span, flags);
+			}
+			cleared |= (node[i] & scan->clear) != 0;
+			node[i] &= ~scan->clear;
+		}
+		else
+		{
+			uint64_t child_addr = node[i] & PTE_ADDR_MASK;
+			scan_node(child_addr, level_index + 1, vpn, shared || get_node_meta(child_addr)->extra_refs > 0, scan);
+			if (!scan->stopped) // the bits of a subtree are cleared only once all of it was
+			{
+				node[i] &= ~scan->clear;
+			}
+		}
+	}
+
+	if (cleared && shared)
+	{
+		scan->flush_all = 1; // the TLB is tagged by table, not by node, so every table is flushed once the scan ends
+	}
+	else if (cleared)
+	{
+		tlb_invalidate_range(scan->pt, vpn_base, span * LEVEL_ENTRIES);
+	}
+}
+
+uint64_t page_table_scan_accessed(uint64_t pt, int hot, int clear, int (*fn)(void* arg, uint64_t vpn, uint64_t count, int flags), void* arg)
+{
+	struct access_scan scan = { fn, arg, hot, (uint64_t) (clear & (PAGE_ACCESSED | PAGE_DIRTY)) << PTE_AD_SHIFT, pt, 0, 0, 0, 0, 0, 0 };
+
+	scan_node(pt << 12, 0, 0, 0, &scan);
+	flush_scan(&scan);
+	if (scan.flush_all)
+	{
+		page_table_tlb_flush();
+	}
+	return scan.runs;
+}
+
+// thread safe variants of query and update. queries load every entry with acquire semantics and never block or
+// retry. updates link new nodes (and split huge entries) with compare-and-swap, so concurrent updates of different
+// pages proceed in parallel, and any number of them run under a shared structure lock. only unlinking an emptied node
+// takes that lock exclusively. an unlinked node may still be read by a query that got to it first, so it is retired
+// and freed through epoch based reclamation once every query that could see it has finished.
+// these don't use the TLB, the walk cache or huge page promotion, and mustn't be mixed with the other updates
+
+#define EPOCH_THREADS 64 // threads that may use the concurrent functions at the same time
+#define EPOCH_ACTIVE 1ULL // set in a thread's epoch slot while it is inside a query
+
+static pthread_rwlock_t structure_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER; // alloc_page_frame and free_page_frame aren't thread safe
+
+static uint64_t global_epoch;
+static uint64_t thread_epochs[EPOCH_THREADS]; // epoch << 1 | EPOCH_ACTIVE of each thread inside a query, 0 otherwise
+static int thread_slot_used[EPOCH_THREADS];
+static _Thread_local int thread_slot = -1;
+static pthread_key_t thread_slot_key;
+static pthread_once_t thread_slot_once = PTHREAD_ONCE_INIT;
+
+// nodes unlinked but maybe still read by queries, each with the epoch it was unlinked in. used under structure_lock
+static struct retired_node
+{
+	uint64_t node_phys_addr;
+	uint64_t epoch;
+}* retired;
+static uint64_t nretired;
+static uint64_t retired_capacity;
+
+uint64_t alloc_frame_locked(void)
+{
+	pthread_mutex_lock(&frame_lock);
+	uint64_t ppn = alloc_page_frame();
+	pthread_mutex_unlock(&frame_lock);
+	return ppn;
+}
+
+void release_node_locked(uint64_t node_phys_addr)
+{
+	pthread_mutex_lock(&frame_lock);
+	release_node(node_phys_addr);
+	pthread_mutex_unlock(&frame_lock);
+}
+
+void release_thread_slot(void* slot)
+{
+	__atomic_store_n(&thread_slot_used[(int) (intptr_t) slot - 1], 0, __ATOMIC_RELEASE);
+}
+
+void create_thread_slot_key(void)
+{
+	if (pthread_key_create(&thread_slot_key, release_thread_slot) != 0)
+		errx(1, "pthread_key_create failed");
+}
+
+// the epoch slot of the calling thread, taken on its first query and given back when it exits
+int get_thread_slot(void)
+{
+	if (thread_slot >= 0)
+	{
+		return thread_slot;
+	}
+
+	pthread_once(&thread_slot_once, create_thread_slot_key);
+	for (int i = 0; i < EPOCH_THREADS; i++)
+	{
+		int unused = 0;
+		if (__atomic_compare_exchange_n(&thread_slot_used[i], &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			thread_slot = i;
+			pthread_setspecific(thread_slot_key, (void*) (intptr_t) (i + 1)); // non NULL so the destructor runs
+			return i;
+		}
+	}
+	errx(1, "too many threads using the concurrent page table functions");
+}
+
+// free the retired nodes no query can reach anymore, advancing the epoch when every active query has seen the
+// current one. a node retired in epoch e is unreachable once the epoch is e + 2. called under the exclusive lock
+void reclaim_retired(void)
+{
+	// a read-modify-write instead of a fence (which -fsanitize=thread can't follow): every unlink before it is seen by
+	// the queries announced after it, and the loads below see the queries announced before it
+	uint64_t epoch = __atomic_fetch_add(&global_epoch, 0, __ATOMIC_SEQ_CST);
+	int can_advance = 1;
+
+	for (int i = 0; i < EPOCH_THREADS; i++)
+	{
+		uint64_t slot_epoch = __atomic_load_n(&thread_epochs[i], __ATOMIC_SEQ_CST);
+		if ((slot_epoch & EPOCH_ACTIVE) && (slot_epoch >> 1) != epoch)
+		{
+			can_advance = 0;
+			break;
+		}
+	}
+	if (can_advance)
+	{
+		__atomic_store_n(&global_epoch, ++epoch, __ATOMIC_SEQ_CST);
+	}
+
+	uint64_t kept = 0;
+	for (uint64_t i = 0; i < nretired; i++)
+	{
+		if (retired[i].epoch + 2 <= epoch)
+		{
+			release_node_locked(retired[i].node_phys_addr);
+		}
+		else
+		{
+			retired[kept++] = retired[i];
+		}
+	}
+	nretired = kept;
+}
+
+void retire_node(uint64_t node_phys_addr)
+{
+	if (nretired == retired_capacity)
+	{
+		retired_capacity = retired_capacity == 0 ? 64 : retired_capacity * 2;
+		retired = realloc(retired, retired_capacity * sizeof(*retired));
+		if (retired == NULL)
+			errx(1, "out of memory for retired nodes");
+	}
+	retired[nretired].node_phys_addr = node_phys_addr;
+	retired[nretired].epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+	nretired++;
+}
+
+uint64_t page_table_query_concurrent(uint64_t pt, uint64_t vpn)
+{
+	int slot = get_thread_slot();
+	uint64_t cur_level_phys_addr = pt << 12;
+	uint64_t ppn = NO_MAPPING;
+
+	// announce the epoch we read in, nodes unlinked from now on stay allocated until we leave. the exchange keeps the
+	// announcement ahead of the walk's loads, which are sequentially consistent (the same instructions as acquire on
+	// x86 and ARMv8) so that they are ordered against the unlinks and reclaim_retired
+	__atomic_exchange_n(&thread_epochs[slot], __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE) << 1 | EPOCH_ACTIVE,
+			__ATOMIC_SEQ_CST);
+
+	UNROLL_LEVELS
+	for (int i = 0; i <= LAST_LEVEL; ++i)
+	{
+		uint64_t* cur_level_ptr = (uint64_t*) phys_to_virt(cur_level_phys_addr);
+		uint64_t cur_pte = __atomic_load_n(&cur_level_ptr[get_vpn_part(vpn, i)], __ATOMIC_SEQ_CST);
+
+		if (!(cur_pte & PTE_VALID))
+		{
+			break;
+		}
+		if (cur_pte & PTE_HUGE)
+		{
+			ppn = (cur_pte >> 12) + (vpn & (level_span(i) - 1));
+			break;
+		}
+		if (i == LAST_LEVEL)
+		{
+			ppn = cur_pte >> 12;
+			break;
+		}
+		cur_level_phys_addr = cur_pte & PTE_ADDR_MASK;
+	}
+
+	__atomic_store_n(&thread_epochs[slot], 0, __ATOMIC_RELEASE);
+	return ppn;
+}
+
+// unlink the emptied last level node on the way to vpn and each ancestor that becomes empty in turn
+void reclaim_empty_concurrent(uint64_t pt, uint64_t vpn)
+{
+	uint64_t path[LAST_LEVEL + 1];
+
+	pthread_rwlock_wrlock(&structure_lock);
+
+	// another update may have refilled or already unlinked the node since it was seen empty
+	int depth = walk_path(pt, vpn, path);
+	for (int i = depth; i > 0 && __atomic_load_n(valid_count(path[i]), __ATOMIC_ACQUIRE) == 0; --i)
+	{
+		uint64_t* parent_ptr = (uint64_t*) phys_to_virt(path[i - 1]);
+		__atomic_store_n(&parent_ptr[get_vpn_part(vpn, i - 1)], 0, __ATOMIC_SEQ_CST); // see reclaim_retired
+		__atomic_sub_fetch(valid_count(path[i - 1]), 1, __ATOMIC_ACQ_REL);
+		retire_node(path[i]);
+	}
+	reclaim_retired();
+
+	pthread_rwlock_unlock(&structure_lock);
+}
+
+void page_table_update_concurrent(uint64_t pt, uint64_t vpn, uint64_t ppn)
+{
+	uint64_t cur_level_phys_addr = pt << 12;
+	int emptied = 0;
+
+	pthread_rwlock_rdlock(&structure_lock);
+
+	for (int i = 0; i < LAST_LEVEL; ++i)
+	{
+		uint64_t* cur_pte_ptr = &((uint64_t*) phys_to_virt(cur_level_phys_addr))[get_vpn_part(vpn, i)];
+		uint64_t cur_pte = __atomic_load_n(cur_pte_ptr, __ATOMIC_ACQUIRE);
+
+		while (!(cur_pte & PTE_VALID) || (cur_pte & PTE_HUGE))
+		{
+			if (!(cur_pte & PTE_VALID) && ppn == NO_MAPPING) // nothing to unmap
+			{
+				pthread_rwlock_unlock(&structure_lock);
+				return;
+			}
+
+			// prepare the new node completely before publishing it, a huge entry is split into it
+			uint64_t next_addr = alloc_frame_locked() << 12;
+			if (cur_pte & PTE_VALID)
+			{
+				uint64_t* next_level_ptr = (uint64_t*) phys_to_virt(next_addr);
+				uint64_t flags = i + 1 == LAST_LEVEL ? PTE_VALID : PTE_VALID | PTE_HUGE;
+				for (int j = 0; j < LEVEL_ENTRIES; j++)
+				{
+					next_level_ptr[j] = (((cur_pte >> 12) + j * level_span(i + 1)) << 12) | flags;
+				}
+				__atomic_store_n(valid_count(next_addr), LEVEL_ENTRIES, __ATOMIC_RELAXED);
+			}
+
+			// on failure another update linked a node first, use it and drop ours (nobody else has seen it)
+			if (__atomic_compare_exchange_n(cur_pte_ptr, &cur_pte, next_addr | PTE_VALID, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			{
+				if (!(cur_pte & PTE_VALID))
+				{
+					__atomic_add_fetch(valid_count(cur_level_phys_addr), 1, __ATOMIC_ACQ_REL);
+				}
+				cur_pte = next_addr | PTE_VALID;
+			}
+			else
+			{
+				release_node_locked(next_addr);
+			}
+		}
+
+		cur_level_phys_addr = cur_pte & PTE_ADDR_MASK;
+	}
+
+	uint64_t* last_pte_ptr = &((uint64_t*) phys_to_virt(cur_level_phys_addr))[get_vpn_part(vpn, LAST_LEVEL)];
+	uint64_t new_pte = ppn == NO_MAPPING ? 0 : (ppn << 12) | PTE_VALID;
+	uint64_t old_pte = __atomic_exchange_n(last_pte_ptr, new_pte, __ATOMIC_ACQ_REL);
+
+	if ((old_pte & PTE_VALID) && !(new_pte & PTE_VALID))
+	{
+		emptied = __atomic_sub_fetch(valid_count(cur_level_phys_addr), 1, __ATOMIC_ACQ_REL) == 0;
+	}
+	else if (!(old_pte & PTE_VALID) && (new_pte & PTE_VALID))
+	{
+		__atomic_add_fetch(valid_count(cur_level_phys_addr), 1, __ATOMIC_ACQ_REL);
+	}
+
+	pthread_rwlock_unlock(&structure_lock);
+
+	if (emptied)
+	{
+		reclaim_empty_concurrent(pt, vpn);
+	}
 }
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+/*
+ * Trace driven benchmark of pt.c. Each trace is generated up front and then
+ * replayed against page_table_query, page_table_query_batch,
+ * page_table_access and page_table_update, so only the page table is timed.
+ * The working set is also mapped and read back whole, page by page and with
+ * page_table_update_range and page_table_query_range. The batched queries
+ * only pay off once the table outgrows the caches (the default 2^20 pages
+ * take about 8 MB of last level nodes, use -p to go beyond the LLC).
+ *
+ * Build it instead of the tests in os.c:
+ *
+ *	gcc -O3 -Wall -std=c11 -pthread -DPT_BENCH os.c pt.c pt_bench.c -lm -o pt_bench
+ *
+ * usage: pt_bench [-n accesses] [-p pages] [-t tlb_sets] [-w walk_cache_entries] [trace...]
+ * where trace is seq, stride, random or zipf (all of them, and the range
+ * calls, by default).
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "os.h"
+
+#define BENCH_VPN_BASE	0x10000000ULL
+#define STRIDE_PAGES	513	/* a new last level node (and its parent's next entry) every access */
+#define ZIPF_SKEW	0.99
+#define BATCH_SIZE	256	/* vpns per page_table_query_batch call */
+
+struct trace {
+	const char* name;
+	void (*generate)(uint64_t* vpns, uint64_t n, uint64_t pages);
+};
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t bench_random(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+/* the ppn mapped to the i-th page of the working set, scattered so that no
+ * node is contiguous and every page keeps its own last level entry */
+static uint64_t bench_ppn(uint64_t i)
+{
+	return (i * 0x9e3779b1ULL) & 0xfffffff;
+}
+
+static void generate_seq(uint64_t* vpns, uint64_t n, uint64_t pages)
+{
+	for (uint64_t i = 0; i < n; i++)
+		vpns[i] = BENCH_VPN_BASE + i % pages;
+}
+
+static void generate_stride(uint64_t* vpns, uint64_t n, uint64_t pages)
+{
+	for (uint64_t i = 0; i < n; i++)
+		vpns[i] = BENCH_VPN_BASE + i * STRIDE_PAGES % pages;
+}
+
+static void generate_random(uint64_t* vpns, uint64_t n, uint64_t pages)
+{
+	for (uint64_t i = 0; i < n; i++)
+		vpns[i] = BENCH_VPN_BASE + bench_random() % pages;
+}
+
+/* rank r is drawn with probability proportional to 1 / (r + 1)^ZIPF_SKEW by
+ * a binary search of the cumulative distribution. ranks are then spread over
+ * the working set by a multiplicative hash, so hot pages aren't neighbours */
+static void generate_zipf(uint64_t* vpns, uint64_t n, uint64_t pages)
+{
+	double* cdf = malloc(pages * sizeof(double));
+	double sum = 0;
+
+	if (cdf == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (uint64_t r = 0; r < pages; r++) {
+		sum += 1.0 / pow((double)(r + 1), ZIPF_SKEW);
+		cdf[r] = sum;
+	}
+
+	for (uint64_t i = 0; i < n; i++) {
+		double u = (double)(bench_random() >> 11) / (double)(1ULL << 53) * sum;
+		uint64_t lo = 0, hi = pages - 1;
+		while (lo < hi) {
+			uint64_t mid = (lo + hi) / 2;
+			if (cdf[mid] < u)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		vpns[i] = BENCH_VPN_BASE + lo * 0x9e3779b1ULL % pages;
+	}
+	free(cdf);
+}
+
+static const struct trace traces[] = {
+	{ "seq", generate_seq },
+	{ "stride", generate_stride },
+	{ "random", generate_random },
+	{ "zipf", generate_zipf },
+};
+
+/* a counter of the last level cache misses of this thread, -1 when
+ * perf_event_open isn't available (no PMU, perf_event_paranoid, ...) */
+static int open_miss_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void start_counter(int fd)
+{
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static uint64_t stop_counter(int fd)
+{
+	uint64_t count = 0;
+
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count))
+			count = 0;
+	}
+	return count;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* trace, const char* op, uint64_t n, double seconds, int counter, uint64_t misses)
+{
+	printf("%-7s %-6s %12.0f translations/s %8.2f ns/walk", trace, op, n / seconds, seconds * 1e9 / n);
+	if (counter >= 0)
+		printf(" %8.3f misses/walk\n", (double)misses / n);
+	else
+		printf("      n/a misses/walk\n");
+}
+
+static int count_run(void* arg, uint64_t vpn, uint64_t count, int flags)
+{
+	(void)arg, (void)vpn, (void)count, (void)flags;
+	return 0;
+}
+
+/* map and read back the whole working set of a fresh table, once a page at a
+ * time and once with the range calls, and report the speedup of the latter */
+static void run_ranges(uint64_t pages, int counter)
+{
+	uint64_t* ppns = malloc(pages * sizeof(uint64_t));
+	uint64_t pt = alloc_page_frame(), checksum = 0, mapped;
+	double start, single, range;
+
+	if (ppns == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < pages; i++)
+		page_table_update(pt, BENCH_VPN_BASE + i, i + 1);
+	single = now() - start;
+	report("pages", "update", pages, single, counter, stop_counter(counter));
+	page_table_destroy(pt);
+
+	pt = alloc_page_frame();
+	start_counter(counter);
+	start = now();
+	page_table_update_range(pt, BENCH_VPN_BASE, pages, 1);
+	range = now() - start;
+	report("range", "update", pages, range, counter, stop_counter(counter));
+	printf("range   update %12.2fx faster than a page at a time\n", single / range);
+
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < pages; i++)
+		checksum += page_table_query(pt, BENCH_VPN_BASE + i);
+	single = now() - start;
+	report("pages", "query", pages, single, counter, stop_counter(counter));
+
+	start_counter(counter);
+	start = now();
+	mapped = page_table_query_range(pt, BENCH_VPN_BASE, pages, ppns);
+	range = now() - start;
+	report("range", "query", pages, range, counter, stop_counter(counter));
+	printf("range   query  %12.2fx faster than a page at a time\n", single / range);
+
+	for (uint64_t i = 0; i < pages; i++)
+		checksum -= ppns[i];
+	if (mapped != pages || checksum != 0) {
+		fprintf(stderr, "range: wrong translations\n");
+		exit(1);
+	}
+	page_table_destroy(pt);
+	free(ppns);
+}
+
+static void run_trace(const struct trace* trace, uint64_t n, uint64_t pages, int counter)
+{
+	uint64_t* vpns = malloc(n * sizeof(uint64_t));
+	uint64_t* ppns = malloc(BATCH_SIZE * sizeof(uint64_t));
+	uint64_t nodes[PT_LEVELS], bytes, runs, checksum = 0, expected = 0;
+	uint64_t pt = alloc_page_frame();
+	double start;
+
+	if (vpns == NULL || ppns == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (uint64_t i = 0; i < pages; i++)
+		page_table_update(pt, BENCH_VPN_BASE + i, bench_ppn(i));
+	trace->generate(vpns, n, pages);
+	for (uint64_t i = 0; i < n; i++)
+		expected += bench_ppn(vpns[i] - BENCH_VPN_BASE);
+
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < n; i++)
+		checksum += page_table_query(pt, vpns[i]);
+	report(trace->name, "query", n, now() - start, counter, stop_counter(counter));
+	if (checksum != expected) {
+		fprintf(stderr, "%s: wrong translations\n", trace->name);
+		exit(1);
+	}
+
+	checksum = 0;
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < n; i += BATCH_SIZE) {
+		uint64_t batch = n - i < BATCH_SIZE ? n - i : BATCH_SIZE;
+		page_table_query_batch(pt, vpns + i, batch, ppns);
+		for (uint64_t j = 0; j < batch; j++)
+			checksum += ppns[j];
+	}
+	report(trace->name, "batch", n, now() - start, counter, stop_counter(counter));
+	if (checksum != expected) {
+		fprintf(stderr, "%s: wrong batched translations\n", trace->name);
+		exit(1);
+	}
+
+	/* a clock reclaimer: mark the trace accessed, then one pass that finds
+	 * the cold pages and starts the next period */
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < n; i++)
+		page_table_access(pt, vpns[i], i & 1);
+	report(trace->name, "access", n, now() - start, counter, stop_counter(counter));
+	start = now();
+	runs = page_table_scan_accessed(pt, 0, PAGE_ACCESSED, count_run, NULL);
+	printf("%-7s scan   %12.3f ms for %llu cold runs\n", trace->name, (now() - start) * 1e3, (unsigned long long)runs);
+
+	/* remapping keeps the working set mapped, so every update walks all levels */
+	start_counter(counter);
+	start = now();
+	for (uint64_t i = 0; i < n; i++)
+		page_table_update(pt, vpns[i], bench_ppn(i));
+	report(trace->name, "update", n, now() - start, counter, stop_counter(counter));
+
+	bytes = page_table_footprint(pt, nodes);
+	printf("%-7s table  %12llu bytes (nodes per level:", trace->name, (unsigned long long)bytes);
+	for (int i = 0; i < PT_LEVELS; i++)
+		printf(" %llu", (unsigned long long)nodes[i]);
+	printf(")\n");
+	page_table_destroy(pt);
+	free(ppns);
+	free(vpns);
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t n = 10 * 1000 * 1000, pages = 1 << 20, tlb_sets = 0, pwc_entries = 0;
+	int opt, counter;
+
+	while ((opt = getopt(argc, argv, "n:p:t:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoull(optarg, NULL, 0);
+			break;
+		case 'p':
+			pages = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			tlb_sets = strtoull(optarg, NULL, 0);
+			break;
+		case 'w':
+			pwc_entries = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n accesses] [-p pages] [-t tlb_sets] [-w walk_cache_entries] [seq|stride|random|zipf...]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n == 0 || pages == 0) {
+		fprintf(stderr, "accesses and pages must be positive\n");
+		return 1;
+	}
+	if (page_table_tlb_configure(tlb_sets, tlb_sets ? 4 : 0) != 0 || page_table_walk_cache_configure(pwc_entries) != 0) {
+		fprintf(stderr, "bad TLB or walk cache size\n");
+		return 1;
+	}
+
+	counter = open_miss_counter();
+	if (counter < 0)
+		fprintf(stderr, "perf_event_open unavailable, cache misses not counted\n");
+
+	for (size_t t = 0; t < sizeof(traces) / sizeof(traces[0]); t++) {
+		int selected = optind == argc;
+		for (int i = optind; i < argc; i++)
+			selected |= strcmp(argv[i], traces[t].name) == 0;
+		if (selected)
+			run_trace(&traces[t], n, pages, counter);
+	}
+	if (optind == argc)
+		run_ranges(pages, counter);
+
+	if (counter >= 0)
+		close(counter);
+	return 0;
+}
@@ -1,222 +1,1622 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <signal.h>
-#include <errno.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-
-
-void signal_handler(int sig_num) {
-
-    struct sigaction sa;
-    memset(&sa, 0, sizeof (sa)); 
-
-    if(sig_num == 0) {
-        signal(SIGINT, SIG_IGN);
-    }
-
-    if(sig_num == 1) {
-        signal(SIGCHLD, SIG_IGN);
-    }
-}
-
-int prepare(void) {
-    signal_handler(1);
-    signal_handler(0);
-    return 0;
-}
-
-void restart_signals(void) {
-    signal(SIGINT, SIG_DFL);
-}
-
-// single process in background
-int run_in_background(char** arguments, int ampersand_index) {
-
-    arguments[ampersand_index] = NULL;
-
-    int pid_status = fork();
-    if (pid_status < 0) {
-        fprintf(stderr, "%s", "Error in child\n");
-        return 0;
-    }
-    if (pid_status == 0) {
-        signal(SIGINT, SIG_IGN);
-        int status = execvp(arguments[0], arguments);
-        if (status == -1) {
-            fprintf(stderr, "%s", "Error in child\n");
-            exit(1);
-        }
-        return 1;
-
-    } else {
-        return 1;
-    }
-}
-
-// pipe
-int run_with_child(char** arguments, int symbol) {
-
-    char** second_command = arguments + symbol + 1;
-    arguments[symbol] = NULL;
-
-    // pipe
-    int file_args[2];
-    if (pipe(file_args) == -1) {
-        fprintf(stderr, "%s", "Error in pipe\n");
-        return 0;
-    }
-    int file_reader = file_args[0];
-    int file_writer = file_args[1];
-
-    int pid_first = fork();
-    if (pid_first < 0) {
-        fprintf(stderr, "%s", "Error in child\n");
-        return 0;
-    }
-    // first child
-    if (pid_first == 0) {
-        restart_signals();
-        while((dup2(file_writer, 1) == -1) && (errno == EINTR)){}
-        close(file_writer);
-        close(file_reader);
-        int status = execvp(arguments[0], arguments);
-        if (status == -1) {
-            fprintf(stderr, "%s", "Error in child\n");
-            exit(1);
-        }
-        return 0;
-
-    } else { 
-        close(file_writer);
-        int pid_second = fork();
-        if (pid_second < 0) {
-            fprintf(stderr, "%s", "Error in child\n");
-            return 0;
-        }
-        // second child
-        if (pid_second == 0) {
-            restart_signals();
-            while((dup2(file_reader, 0) == -1) && (errno == EINTR)){}
-            close(file_reader);
-            int status2 = execvp(second_command[0], second_command);
-            if (status2 == -1) {
-                fprintf(stderr, "%s", "Error in child\n");
-                exit(1);
-            }
-            return 0;
-
-        } else {
-            close(file_reader);
-            if (waitpid(pid_first, NULL, 0) != -1 && errno != ECHILD && errno != EINTR) {
-                fprintf(stderr, "%s", "Error in child\n");
-                return 0;
-            }
-            if (waitpid(pid_second, NULL, 0) != -1 && errno != ECHILD && errno != EINTR) {
-                fprintf(stderr, "%s", "Error in child\n");
-                return 0;
-            }
-            return 1;
-        }
-    }
-}
-
-int run_with_redirection(char** arguments, int symbol) {
-
-    char* output_file = arguments[symbol + 1];
-    arguments[symbol] = NULL;
-    int pid_status = fork();
-
-    if (pid_status < 0) {
-        fprintf(stderr, "%s", "Error in child\n");
-        return 0;
-    }
-    if (pid_status == 0) {
-        restart_signals();
-        int fd = open(output_file, O_WRONLY | O_CREAT, 0777);
-        close(1); 
-        dup2(fd, 1);  
-        int status = execvp(arguments[0], arguments);
-        if (status == -1) {
-            fprintf(stderr, "%s", "Error in child\n");
-            return 0;
-        }
-        close(fd);
-        return 1;
-
-    } else {
-        if (waitpid(pid_status, NULL, 0) != -1 && errno != ECHILD && errno != EINTR) {
-            fprintf(stderr, "%s", "Error in child\n");
-            return 0;
-        }
-        return 1;
-    }
-
-}
-
-int process_arglist(int count, char** arguments) {
-
-    int return_value = 0;
-    int special_char_index = -1;
-	for (int i = 0; i < count; i++) {
-        if (strcmp(arguments[i], "&") == 0) {
-            special_char_index = i;
-			break;
-        }
-        if (strcmp(arguments[i], "|") == 0) {
-            special_char_index = i;
-			break;
-        }
-        if (strcmp(arguments[i], ">") == 0) {
-            special_char_index = i;
-			break;
-        }
-    }
-    // symbols "&", "|", ">" not found
-	if (special_char_index == -1) {
-		int pid_status = fork();
-		if (pid_status < 0) {
-			fprintf(stderr, "%s", "Error in child\n");
-			return_value = 0;
-		}
-		if (pid_status == 0) {
-			restart_signals();
-			int status = execvp(arguments[0], arguments);
-			if (status == -1) {
-				fprintf(stderr, "%s", "Error in child\n");
-				exit(1);
-			}
-			return_value = 1;
-
-		} else {
-            if (waitpid(pid_status, NULL, 0) != -1 && errno != ECHILD && errno != EINTR) {
-                fprintf(stderr, "%s", "Error in child\n");
-                return 0;
-            }
-			return_value = 1;
-		}
-	} else {
-		// pipe
-        if(strcmp(arguments[special_char_index], "|") == 0) {
-            return_value = run_with_child(arguments, special_char_index);
-        }
-        // run in background
-        else if(strcmp(arguments[special_char_index], "&") == 0) {
-            return_value = run_in_background(arguments, special_char_index);
-        }
-        // redirect
-        else {
-            return_value = run_with_redirection(arguments, special_char_index);
-        }
-    } 
-    return return_value;
-}
-
-
-
-int finalize(void) {
-    return 0;
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>
+
+extern char** environ;
+
+// children are started with posix_spawn instead of fork. glibc launches them with clone(CLONE_VM|CLONE_VFORK),
+// so nothing of the shell's memory is copied and the launch time doesn't depend on how large the shell is.
+// the attributes replace what the children used to do after fork: foreground ones get SIGINT back, and all of them
+// get SIGPIPE back and SIGCHLD unblocked, as the shell's ignored and blocked signals would otherwise survive the exec
+static posix_spawnattr_t foreground_attr;
+static posix_spawnattr_t background_attr;
+
+// capacity given to every pipe of a pipeline with F_SETPIPE_SZ, taken from MYSHELL_PIPE_SIZE (in bytes).
+// 0 keeps the default of 64 KB. larger pipes let producers and consumers run longer between context switches
+static int pipe_size;
+
+// bytes reserved with fallocate for every file opened by ">" or ">>", taken from MYSHELL_FALLOCATE. 0 doesn't
+// reserve anything. large writers then get their file in few extents and don't allocate blocks as they go
+static off_t preallocate;
+
+#define SPLICE_CHUNK (1 << 20) // bytes the splice stage asks to move at once
+
+// "splice [file]" is a built in pipeline stage that copies its input to its output like cat (and also to file,
+// like tee). it runs as a thread of the shell and moves the data with splice and tee, so it never passes
+// through user space when its neighbours are pipes
+struct splice_stage {
+    int in_fd;
+    int out_fd;
+    int tee_fd; // -1 without a file
+    pthread_t thread;
+};
+
+#define JOB_NAME_SIZE 32
+#define JOBS_MIN_CAPACITY 64
+#define JOBS_DONE_MAX 64 // finished background jobs kept for "jobs", older ones are forgotten unreported
+
+#define CPU_PERIOD_US 100000 // cpu.max period of the "limit -c" quota
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+// "limit" runs a command (a pipeline, a background job...) as a job group: all its children share one cgroup v2
+// with the group's CPU quota, memory cap and I/O weight, and the group's usage is reported when its last child is
+// reaped. a limit the cgroup can't enforce (no cgroup v2, or the controller isn't delegated to us) falls back to
+// the nearest rlimit, or ioprio for the weight, set by every child before it executes
+struct job_group {
+    int cpu_percent; // 0 for each limit that isn't set
+    long long memory;
+    int io_weight;
+    long cpu_seconds; // RLIMIT_CPU only, cgroups have no total
+    int rlimit_memory; // memory falls back to RLIMIT_AS
+    int ioprio_weight; // io_weight falls back to ioprio
+    int no_clone3; // clone3 failed, the children are started by posix_spawn and limited after it
+    int cgroup_fd; // -1 when the group has no cgroup
+    char cgroup[PATH_MAX];
+    int live; // children not reaped yet, plus one while "limit" still starts them
+    struct rusage usage; // summed over the reaped children, but ru_maxrss is their maximum
+    struct timespec started;
+    char name[JOB_NAME_SIZE];
+};
+
+static struct job_group* current_group; // the group of the "limit" being run, for spawn_command
+static char cgroup_root[PATH_MAX]; // the shell's own cgroup v2 directory for the groups, empty if there's none
+static int cgroup_checked;
+static unsigned long groups_created;
+
+// every child the shell started and didn't report yet. SIGCHLD is blocked and read from a signalfd, so children
+// stay zombies until reap_children collects them with wait4, along with their exit status and resource usage
+struct job {
+    pid_t pid; // 0 for a free slot
+    int background;
+    int done;
+    int status;
+    struct rusage usage;
+    struct timespec started;
+    struct timespec ended;
+    long spawn_ns; // time posix_spawn took, until the command was executed
+    unsigned long finished; // order in which the background job finished, 0 while it runs
+    struct job_group* group; // NULL unless started by "limit"
+    char name[JOB_NAME_SIZE];
+};
+
+// open addressing hash table of the jobs by pid, with linear probing. it's kept at most half full
+static struct job* jobs;
+static size_t jobs_capacity;
+static size_t jobs_count;
+
+// the background jobs that finished and "jobs" didn't report yet, oldest first, as a ring. an entry whose pid was
+// reused by a newer job no longer matches its finished number and is just dropped
+static struct {
+    pid_t pid;
+    unsigned long finished;
+} jobs_done[JOBS_DONE_MAX];
+static size_t jobs_done_head;
+static size_t jobs_done_count;
+static unsigned long jobs_finished;
+static int child_fd = -1; // signalfd of SIGCHLD
+
+// exit status of the last command, for "&&" and "||". a pipeline's is its last stage's
+static int last_status;
+
+// MYSHELL_TRACE names a file that gets one JSON line per finished child: its wall, user and sys time, max RSS
+// and how long posix_spawn took to start it
+static FILE* trace;
+
+#define COMMANDS_MIN_CAPACITY 64
+
+// where the commands without a "/" were found in PATH, so that launching them again is a single execve instead
+// of one failed execve per directory before theirs. like bash's hash, an entry is dropped when its binary
+// disappears, and the whole table when PATH changes
+struct command_path {
+    char* name; // NULL for a free slot
+    char* path;
+    size_t hash;
+    unsigned long hits;
+};
+
+// open addressing hash table by name with linear probing, like the jobs. it's kept at most half full
+static struct command_path* commands;
+static size_t commands_capacity;
+static size_t commands_count;
+static char* commands_path; // the PATH the table was filled from
+
+
+void signal_handler(int sig_num) {
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof (sa)); 
+
+    if(sig_num == 0) {
+        signal(SIGINT, SIG_IGN);
+    }
+
+    if(sig_num == 1) {
+        // children are reaped by the shell, SIGCHLD must not be ignored or the kernel reaps them first
+        sigset_t child;
+        sigemptyset(&child);
+        sigaddset(&child, SIGCHLD);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_BLOCK, &child, NULL);
+        child_fd = signalfd(-1, &child, SFD_NONBLOCK | SFD_CLOEXEC);
+    }
+}
+
+struct job* find_job(pid_t pid) {
+    if (jobs_capacity == 0) {
+        return NULL;
+    }
+    size_t mask = jobs_capacity - 1;
+    for (size_t slot = (size_t)pid & mask; jobs[slot].pid != 0; slot = (slot + 1) & mask) {
+        if (jobs[slot].pid == pid) {
+            return &jobs[slot];
+        }
+    }
+    return NULL;
+}
+
+// slot for pid, growing the table when it would be more than half full. NULL if out of memory
+struct job* add_job(pid_t pid) {
+    struct job* stale = find_job(pid);
+    if (stale != NULL) { // a finished job kept for "jobs" whose pid the kernel gave to a new child
+        memset(stale, 0, sizeof(struct job));
+        stale->pid = pid;
+        return stale;
+    }
+    if ((jobs_count + 1) * 2 > jobs_capacity) {
+        size_t old_capacity = jobs_capacity;
+        struct job* old_jobs = jobs;
+        size_t capacity = old_capacity ? old_capacity * 2 : JOBS_MIN_CAPACITY;
+        struct job* grown = calloc(capacity, sizeof(struct job));
+        if (grown == NULL) {
+            return NULL;
+        }
+        jobs = grown;
+        jobs_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_jobs[i].pid != 0) {
+                size_t slot = (size_t)old_jobs[i].pid & (capacity - 1);
+                while (jobs[slot].pid != 0) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                jobs[slot] = old_jobs[i];
+            }
+        }
+        free(old_jobs);
+    }
+
+    size_t mask = jobs_capacity - 1;
+    size_t slot = (size_t)pid & mask;
+    while (jobs[slot].pid != 0) {
+        slot = (slot + 1) & mask;
+    }
+    memset(&jobs[slot], 0, sizeof(struct job));
+    jobs[slot].pid = pid;
+    jobs_count++;
+    return &jobs[slot];
+}
+
+// free the job's slot, moving back the entries of its probe chain so that lookups need no tombstones
+void remove_job(struct job* job) {
+    size_t mask = jobs_capacity - 1;
+    size_t hole = (size_t)(job - jobs);
+    size_t slot = hole;
+
+    while (1) {
+        slot = (slot + 1) & mask;
+        if (jobs[slot].pid == 0) {
+            break;
+        }
+        size_t home = (size_t)jobs[slot].pid & mask;
+        // the entry may fill the hole unless its home lies cyclically in (hole, slot]
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            jobs[hole] = jobs[slot];
+            hole = slot;
+        }
+    }
+    jobs[hole].pid = 0;
+    jobs_count--;
+}
+
+double seconds_between(const struct timespec* start, const struct timespec* end) {
+    return (double)(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// the shell's view of a wait status: the exit code, or 128 plus the signal that killed the child
+int exit_code(int status) {
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void trace_job(const struct job* job) {
+    fprintf(trace, "{\"pid\":%d,\"command\":\"", job->pid);
+    for (const char* c = job->name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(trace, "\\%c", *c);
+        } else if ((unsigned char)*c < ' ') {
+            fprintf(trace, "\\u%04x", *c);
+        } else {
+            fputc(*c, trace);
+        }
+    }
+    fprintf(trace, "\",\"background\":%d,\"status\":%d,\"wall_s\":%.6f,\"user_s\":%ld.%06ld,\"sys_s\":%ld.%06ld,"
+            "\"maxrss_kb\":%ld,\"spawn_us\":%.1f}\n", job->background, exit_code(job->status),
+            seconds_between(&job->started, &job->ended),
+            (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec,
+            (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec,
+            job->usage.ru_maxrss, job->spawn_ns / 1e3);
+}
+
+// write value to the file of a cgroup directory. returns -1 if the file is missing or refuses it
+int write_cgroup_file(const char* directory, const char* file, const char* value) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", directory, file) >= (int)sizeof(path)) {
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// the sum of the "key value" (or "key=value") fields called key in a cgroup file, -1 if it has none
+long long read_cgroup_value(int cgroup_fd, const char* file, const char* key) {
+    char text[4096];
+    int fd = openat(cgroup_fd, file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0) {
+        return -1;
+    }
+    text[length] = '\0';
+
+    if (key[0] == '\0') { // a file of a single value
+        return atoll(text);
+    }
+    long long total = -1;
+    size_t key_length = strlen(key);
+    for (char* field = text; (field = strstr(field, key)) != NULL; field += key_length) {
+        int starts_field = field == text || field[-1] == ' ' || field[-1] == '\n';
+        if (starts_field && (field[key_length] == ' ' || field[key_length] == '=')) {
+            total = (total == -1 ? 0 : total) + atoll(field + key_length + 1);
+        }
+    }
+    return total;
+}
+
+// find the cgroup v2 the shell is in and make a directory for its groups under it, once. the directory has no
+// processes, so it may enable the controllers for its children as far as its parent delegates them. the parent's
+// cgroup.subtree_control is left alone, it belongs to whoever set up the hierarchy (the root cgroup when run as
+// root), so the controllers it doesn't delegate already are missing and the groups use the rlimit fallbacks
+void find_cgroup_root(void) {
+    char line[PATH_MAX * 2];
+    char mount[PATH_MAX] = "";
+    char own[PATH_MAX] = "";
+
+    cgroup_checked = 1;
+    FILE* mounts = fopen("/proc/self/mountinfo", "re");
+    if (mounts != NULL) {
+        while (fgets(line, sizeof(line), mounts) != NULL) {
+            char point[PATH_MAX];
+            char* type = strstr(line, " - cgroup2 ");
+            if (type != NULL && sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+                strcpy(mount, point);
+                break;
+            }
+        }
+        fclose(mounts);
+    }
+    FILE* groups = fopen("/proc/self/cgroup", "re");
+    if (groups != NULL) {
+        while (fgets(line, sizeof(line), groups) != NULL) {
+            if (strncmp(line, "0::", 3) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                if (snprintf(own, sizeof(own), "%s", line + 3) >= (int)sizeof(own)) {
+                    own[0] = '\0';
+                }
+                break;
+            }
+        }
+        fclose(groups);
+    }
+    if (mount[0] == '\0' || own[0] == '\0') {
+        return;
+    }
+
+    char parent[PATH_MAX];
+    if (snprintf(parent, sizeof(parent), "%s%s", mount, strcmp(own, "/") == 0 ? "" : own) >= (int)sizeof(parent) ||
+        snprintf(cgroup_root, sizeof(cgroup_root), "%s/myshell-%d", parent, getpid()) >= (int)sizeof(cgroup_root) ||
+        (mkdir(cgroup_root, 0755) == -1 && errno != EEXIST)) {
+        cgroup_root[0] = '\0';
+        return;
+    }
+    // each controller on its own, as one that isn't delegated fails the whole write
+    const char* controllers[] = {"+cpu", "+memory", "+io"};
+    for (int i = 0; i < 3; i++) {
+        write_cgroup_file(cgroup_root, "cgroup.subtree_control", controllers[i]);
+    }
+}
+
+// a new group with the limits set in its cgroup, or marked for the fallbacks. NULL if out of memory
+struct job_group* create_group(int cpu_percent, long long memory, int io_weight, long cpu_seconds, const char* name) {
+    struct job_group* group = calloc(1, sizeof(struct job_group));
+    if (group == NULL) {
+        return NULL;
+    }
+    group->cpu_percent = cpu_percent;
+    group->memory = memory;
+    group->io_weight = io_weight;
+    group->cpu_seconds = cpu_seconds;
+    group->cgroup_fd = -1;
+    group->live = 1;
+    clock_gettime(CLOCK_MONOTONIC, &group->started);
+    strncpy(group->name, name, JOB_NAME_SIZE - 1);
+
+    if (!cgroup_checked) {
+        find_cgroup_root();
+    }
+    if (cgroup_root[0] != '\0') {
+        if (snprintf(group->cgroup, sizeof(group->cgroup), "%s/%lu", cgroup_root, ++groups_created) <
+            (int)sizeof(group->cgroup) && mkdir(group->cgroup, 0755) == 0) {
+            group->cgroup_fd = open(group->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+
+    char value[64];
+    if (cpu_percent > 0) {
+        snprintf(value, sizeof(value), "%ld %d", (long)cpu_percent * CPU_PERIOD_US / 100, CPU_PERIOD_US);
+        if (group->cgroup_fd == -1 || write_cgroup_file(group->cgroup, "cpu.max", value) != 0) {
+            // a quota has no rlimit counterpart
+            fprintf(stderr, "%s", "limit: no cpu controller, the cpu quota is not applied\n");
+        }
+    }
+    if (memory > 0) {
+        snprintf(value, sizeof(value), "%lld", memory);
+        group->rlimit_memory = group->cgroup_fd == -1 || write_cgroup_file(group->cgroup, "memory.max", value) != 0;
+    }
+    if (io_weight > 0) {
+        snprintf(value, sizeof(value), "default %d", io_weight);
+        group->ioprio_weight = group->cgroup_fd == -1 || write_cgroup_file(group->cgroup, "io.weight", value) != 0;
+    }
+    return group;
+}
+
+// drop a reference to the group. the last one reports its usage and removes its cgroup
+void release_group(struct job_group* group) {
+    if (--group->live > 0) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    fprintf(stderr, "limit: %s %.3fs user %ld.%06lds sys %ld.%06lds maxrss %ldKB", group->name,
+            seconds_between(&group->started, &now),
+            (long)group->usage.ru_utime.tv_sec, (long)group->usage.ru_utime.tv_usec,
+            (long)group->usage.ru_stime.tv_sec, (long)group->usage.ru_stime.tv_usec, group->usage.ru_maxrss);
+    if (group->cgroup_fd != -1) {
+        long long cpu = read_cgroup_value(group->cgroup_fd, "cpu.stat", "usage_usec");
+        long long peak = read_cgroup_value(group->cgroup_fd, "memory.peak", "");
+        long long read_bytes = read_cgroup_value(group->cgroup_fd, "io.stat", "rbytes");
+        long long write_bytes = read_cgroup_value(group->cgroup_fd, "io.stat", "wbytes");
+        if (cpu != -1) {
+            fprintf(stderr, " cgroup cpu %lld.%06llds", cpu / 1000000, cpu % 1000000);
+        }
+        if (peak != -1) {
+            fprintf(stderr, " memory peak %lldKB", peak / 1024);
+        }
+        if (read_bytes != -1) {
+            fprintf(stderr, " io read %lldB write %lldB", read_bytes, write_bytes);
+        }
+        close(group->cgroup_fd);
+        rmdir(group->cgroup);
+    }
+    fprintf(stderr, "\n");
+    free(group);
+}
+
+// forget the background job that finished first, so that jobs no one lists don't fill the table
+void forget_oldest_done(void) {
+    struct job* job = find_job(jobs_done[jobs_done_head].pid);
+    if (job != NULL && job->finished == jobs_done[jobs_done_head].finished) {
+        remove_job(job);
+    }
+    jobs_done_head = (jobs_done_head + 1) % JOBS_DONE_MAX;
+    jobs_done_count--;
+}
+
+// collect every child that has finished, without blocking
+void reap_children(void) {
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    // the signals only wake up poll, several exits may share one of them so wait4 decides who is done
+    while (read(child_fd, &info, sizeof(info)) == sizeof(info)) {
+    }
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        struct job* job = find_job(pid);
+        if (job != NULL) {
+            job->done = 1;
+            job->status = status;
+            job->usage = usage;
+            clock_gettime(CLOCK_MONOTONIC, &job->ended);
+            if (trace != NULL) {
+                trace_job(job);
+            }
+            if (job->group != NULL) {
+                struct rusage* total = &job->group->usage;
+                timeradd(&total->ru_utime, &usage.ru_utime, &total->ru_utime);
+                timeradd(&total->ru_stime, &usage.ru_stime, &total->ru_stime);
+                total->ru_maxrss = usage.ru_maxrss > total->ru_maxrss ? usage.ru_maxrss : total->ru_maxrss;
+                release_group(job->group);
+                job->group = NULL;
+            }
+            if (job->background) {
+                if (jobs_done_count == JOBS_DONE_MAX) {
+                    forget_oldest_done();
+                }
+                job->finished = ++jobs_finished;
+                size_t tail = (jobs_done_head + jobs_done_count++) % JOBS_DONE_MAX;
+                jobs_done[tail].pid = job->pid;
+                jobs_done[tail].finished = job->finished;
+            }
+        }
+    }
+}
+
+
+// the "jobs" built in: list the background jobs, and forget the finished ones once they are reported
+int list_jobs(void) {
+    struct timespec now;
+
+    reap_children();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < jobs_capacity; i++) {
+        struct job* job = &jobs[i];
+        if (job->pid == 0 || !job->background) {
+            continue;
+        }
+        if (!job->done) {
+            printf("[%d] running %.3fs %s\n", job->pid, seconds_between(&job->started, &now), job->name);
+            continue;
+        }
+        if (WIFEXITED(job->status)) {
+            printf("[%d] exit %d", job->pid, WEXITSTATUS(job->status));
+        } else {
+            printf("[%d] signal %d", job->pid, WTERMSIG(job->status));
+        }
+        printf(" %.3fs user %ld.%06lds sys %ld.%06lds maxrss %ldKB %s\n",
+               seconds_between(&job->started, &job->ended),
+               (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec,
+               (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec,
+               job->usage.ru_maxrss, job->name);
+    }
+    // the backward shift of remove_job moves entries into the freed slot, so recheck it until it keeps one
+    for (size_t i = 0; i < jobs_capacity; i++) {
+        while (jobs[i].pid != 0 && jobs[i].background && jobs[i].done) {
+            remove_job(&jobs[i]);
+        }
+    }
+    jobs_done_count = 0;
+    fflush(stdout);
+    return 1;
+}
+
+int init_spawn_attr(posix_spawnattr_t* attr, int background) {
+    sigset_t defaults;
+    sigset_t mask;
+
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    if (!background) {
+        sigaddset(&defaults, SIGINT);
+    }
+    sigemptyset(&mask);
+
+    if (posix_spawnattr_init(attr) != 0 ||
+        posix_spawnattr_setsigdefault(attr, &defaults) != 0 ||
+        posix_spawnattr_setsigmask(attr, &mask) != 0 ||
+        posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+size_t hash_name(const char* name) {
+    size_t hash = 14695981039346656037ULL; // FNV-1a
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+struct command_path* find_command(const char* name, size_t hash) {
+    if (commands_capacity == 0) {
+        return NULL;
+    }
+    size_t mask = commands_capacity - 1;
+    for (size_t slot = hash & mask; commands[slot].name != NULL; slot = (slot + 1) & mask) {
+        if (commands[slot].hash == hash && strcmp(commands[slot].name, name) == 0) {
+            return &commands[slot];
+        }
+    }
+    return NULL;
+}
+
+void remove_command(struct command_path* command) {
+    size_t mask = commands_capacity - 1;
+    size_t hole = (size_t)(command - commands);
+    size_t slot = hole;
+
+    free(command->name);
+    free(command->path);
+    while (1) {
+        slot = (slot + 1) & mask;
+        if (commands[slot].name == NULL) {
+            break;
+        }
+        size_t home = commands[slot].hash & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+            commands[hole] = commands[slot];
+            hole = slot;
+        }
+    }
+    commands[hole].name = NULL;
+    commands[hole].path = NULL;
+    commands_count--;
+}
+
+void forget_commands(void) {
+    for (size_t i = 0; i < commands_capacity; i++) {
+        free(commands[i].name);
+        free(commands[i].path);
+    }
+    free(commands);
+    free(commands_path);
+    commands = NULL;
+    commands_capacity = 0;
+    commands_count = 0;
+    commands_path = NULL;
+}
+
+// remember that name is at path. the table is only a cache, so running out of memory just skips it
+void add_command(const char* name, size_t hash, const char* path) {
+    if ((commands_count + 1) * 2 > commands_capacity) {
+        size_t capacity = commands_capacity ? commands_capacity * 2 : COMMANDS_MIN_CAPACITY;
+        struct command_path* grown = calloc(capacity, sizeof(struct command_path));
+        if (grown == NULL) {
+            return;
+        }
+        for (size_t i = 0; i < commands_capacity; i++) {
+            if (commands[i].name != NULL) {
+                size_t slot = commands[i].hash & (capacity - 1);
+                while (grown[slot].name != NULL) {
+                    slot = (slot + 1) & (capacity - 1);
+                }
+                grown[slot] = commands[i];
+            }
+        }
+        free(commands);
+        commands = grown;
+        commands_capacity = capacity;
+    }
+
+    char* name_copy = strdup(name);
+    char* path_copy = strdup(path);
+    if (name_copy == NULL || path_copy == NULL) {
+        free(name_copy);
+        free(path_copy);
+        return;
+    }
+    size_t mask = commands_capacity - 1;
+    size_t slot = hash & mask;
+    while (commands[slot].name != NULL) {
+        slot = (slot + 1) & mask;
+    }
+    commands[slot].name = name_copy;
+    commands[slot].path = path_copy;
+    commands[slot].hash = hash;
+    commands[slot].hits = 0;
+    commands_count++;
+}
+
+// search PATH for an executable regular file called name, like execvp. fills path and returns 0 if found
+int search_path(const char* name, char* path, size_t size) {
+    const char* directories = getenv("PATH");
+    if (directories == NULL) {
+        directories = "/bin:/usr/bin";
+    }
+
+    while (1) {
+        const char* end = strchrnul(directories, ':');
+        int length = (int)(end - directories);
+        struct stat info;
+        // an empty entry is the current directory
+        if (snprintf(path, size, "%.*s%s%s", length, directories, length ? "/" : "", name) < (int)size &&
+            stat(path, &info) == 0 && S_ISREG(info.st_mode) && access(path, X_OK) == 0) {
+            return 0;
+        }
+        if (*end == '\0') {
+            return -1;
+        }
+        directories = end + 1;
+    }
+}
+
+// the path to execute for name: name itself when it has a "/", else its entry in the table, filled on a miss.
+// NULL when it isn't found. the returned pointer is valid until the next call
+const char* resolve_command(const char* name) {
+    static char found[PATH_MAX];
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    const char* path = getenv("PATH");
+    if (path == NULL) {
+        path = "";
+    }
+    if (commands_path == NULL || strcmp(commands_path, path) != 0) {
+        forget_commands();
+        commands_path = strdup(path);
+    }
+
+    size_t hash = hash_name(name);
+    struct command_path* command = find_command(name, hash);
+    if (command != NULL) {
+        command->hits++;
+        return command->path;
+    }
+    if (search_path(name, found, sizeof(found)) != 0) {
+        return NULL;
+    }
+    add_command(name, hash, found);
+    command = find_command(name, hash);
+    if (command != NULL) {
+        command->hits++;
+    }
+    return found;
+}
+
+// the "hash" built in. alone it lists the table with the hits of every entry, "hash -r" empties it and
+// "hash name ..." looks the names up again
+int run_hash(char** arguments, int count) {
+    if (count == 2 && strcmp(arguments[1], "-r") == 0) {
+        forget_commands();
+        return 1;
+    }
+    if (count == 1) {
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < commands_capacity; i++) {
+            if (commands[i].name != NULL) {
+                printf("%4lu\t%s\n", commands[i].hits, commands[i].path);
+            }
+        }
+        fflush(stdout);
+        return 1;
+    }
+
+    for (int i = 1; i < count; i++) {
+        struct command_path* command = commands_path != NULL ? find_command(arguments[i], hash_name(arguments[i])) : NULL;
+        if (command != NULL) {
+            remove_command(command);
+        }
+        if (resolve_command(arguments[i]) == NULL) {
+            fprintf(stderr, "hash: %s: not found\n", arguments[i]);
+            last_status = 1;
+        } else if ((command = find_command(arguments[i], hash_name(arguments[i]))) != NULL) {
+            command->hits = 0;
+        }
+    }
+    return 1;
+}
+
+int prepare(void) {
+    signal_handler(1);
+    signal_handler(0);
+    if (child_fd == -1) {
+        fprintf(stderr, "%s", "Error in signalfd\n");
+        return -1;
+    }
+
+    const char* trace_file = getenv("MYSHELL_TRACE");
+    if (trace_file != NULL && (trace = fopen(trace_file, "ae")) == NULL) {
+        fprintf(stderr, "%s", "Error in trace file\n");
+        return -1;
+    }
+    // a splice stage whose reader quit gets EPIPE instead of killing the shell
+    signal(SIGPIPE, SIG_IGN);
+
+    const char* size = getenv("MYSHELL_PIPE_SIZE");
+    if (size != NULL) {
+        pipe_size = atoi(size);
+    }
+    size = getenv("MYSHELL_FALLOCATE");
+    if (size != NULL) {
+        preallocate = atoll(size);
+    }
+
+    if (init_spawn_attr(&foreground_attr, 0) != 0 || init_spawn_attr(&background_attr, 1) != 0) {
+        fprintf(stderr, "%s", "Error in spawn attributes\n");
+        return -1;
+    }
+    return 0;
+}
+
+void close_redirections(int files[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (files[i] != -1) {
+            close(files[i]);
+        }
+    }
+}
+
+// open the files of the "<", ">", ">>" and "2>" redirections in arguments into files (the descriptors for 0, 1
+// and 2, -1 where there is none), and remove them from arguments. they are opened by the shell with O_CLOEXEC,
+// so only the command they are for gets them, as its dup2 copies. returns -1 after reporting a failure
+int open_redirections(char** arguments, int files[3]) {
+    files[0] = files[1] = files[2] = -1;
+
+    int i = 0;
+    while (arguments[i] != NULL) {
+        int target;
+        int flags = O_CLOEXEC;
+        if (strcmp(arguments[i], "<") == 0) {
+            target = 0;
+            flags |= O_RDONLY;
+        } else if (strcmp(arguments[i], ">") == 0 || strcmp(arguments[i], "2>") == 0) {
+            target = arguments[i][0] == '2' ? 2 : 1;
+            flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (strcmp(arguments[i], ">>") == 0) {
+            target = 1;
+            flags |= O_WRONLY | O_CREAT | O_APPEND;
+        } else {
+            i++;
+            continue;
+        }
+
+        int fd = arguments[i + 1] != NULL ? open(arguments[i + 1], flags, 0666) : -1;
+        if (fd == -1) {
+            fprintf(stderr, "%s", "Error in redirection\n");
+            close_redirections(files);
+            return -1;
+        }
+        if (preallocate > 0 && target != 0) {
+            // beyond the current end and without changing the size, so readers never see the reserved blocks.
+            // file systems without fallocate just don't reserve
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, lseek(fd, 0, SEEK_END), preallocate);
+        }
+        if (files[target] != -1) { // the last redirection of a descriptor wins, as in sh
+            close(files[target]);
+        }
+        files[target] = fd;
+
+        for (int j = i; arguments[j] != NULL; j++) {
+            arguments[j] = arguments[j + 2];
+            if (arguments[j] == NULL) {
+                break;
+            }
+        }
+    }
+    return 0;
+}
+
+// the ioprio of an io weight: weights 1 to 10000 onto the best effort levels 7 (lowest) to 0
+int ioprio_of_weight(int io_weight) {
+    return (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | (10000 - io_weight) * 7 / 9999;
+}
+
+// the part of a child of a group between clone3 and execve. it runs in a copy of the shell that may have
+// other threads, so only system calls here
+void exec_in_group(const char* path, char** arguments, const int fds[3], int background, struct job_group* group) {
+    struct sigaction action;
+    sigset_t empty;
+
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] == i) {
+            fcntl(i, F_SETFD, 0); // its copy would be itself, just keep it open
+        } else if (fds[i] != -1 && dup2(fds[i], i) == -1) {
+            return;
+        }
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &action, NULL);
+    sigaction(SIGPIPE, &action, NULL);
+    if (!background) {
+        sigaction(SIGINT, &action, NULL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (group->rlimit_memory) {
+        struct rlimit limit = {group->memory, group->memory};
+        if (setrlimit(RLIMIT_AS, &limit) == -1) {
+            return;
+        }
+    }
+    if (group->cpu_seconds > 0) {
+        struct rlimit limit = {group->cpu_seconds, group->cpu_seconds};
+        if (setrlimit(RLIMIT_CPU, &limit) == -1) {
+            return;
+        }
+    }
+    if (group->ioprio_weight) {
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, ioprio_of_weight(group->io_weight));
+    }
+    execve(path, arguments, environ);
+}
+
+// clone3 is refused (ENOSYS or EPERM from a seccomp filter, EINVAL from a kernel without CLONE_INTO_CGROUP), so
+// the group's children can't join its cgroup. they keep only the limits a process can have on its own
+void limit_without_cgroup(struct job_group* group) {
+    fprintf(stderr, "limit: clone3 unavailable, only rlimits and ioprio are applied%s\n",
+            group->cpu_percent > 0 ? " (not the cpu quota)" : "");
+    group->rlimit_memory = group->memory > 0;
+    group->ioprio_weight = group->io_weight > 0;
+    group->no_clone3 = 1;
+}
+
+// the limits of exec_in_group, for a child posix_spawn already started. it runs unlimited until they are set,
+// and is killed if they can't be
+int limit_spawned(pid_t pid, const struct job_group* group) {
+    if (group->rlimit_memory) {
+        struct rlimit limit = {group->memory, group->memory};
+        if (prlimit(pid, RLIMIT_AS, &limit, NULL) == -1) {
+            return errno;
+        }
+    }
+    if (group->cpu_seconds > 0) {
+        struct rlimit limit = {group->cpu_seconds, group->cpu_seconds};
+        if (prlimit(pid, RLIMIT_CPU, &limit, NULL) == -1) {
+            return errno;
+        }
+    }
+    if (group->ioprio_weight) {
+        syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, pid, ioprio_of_weight(group->io_weight));
+    }
+    return 0;
+}
+
+// start a child of group. glibc 2.36 has no posix_spawnattr_setcgroup_np, so this is clone3 with
+// CLONE_INTO_CGROUP, which puts the child in the group's cgroup as it is created (no helper process and no
+// window outside of it). it can't share the shell's memory as posix_spawn does, so this is the price of a fork.
+// CLONE_VFORK still holds the shell until the child executed, and the child's errno comes back through a pipe.
+// where clone3 is refused the children are started by posix_spawn after all, and limited once they run
+int spawn_in_group(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions,
+                   const posix_spawnattr_t* attr, char** arguments, const int fds[3], int background,
+                   struct job_group* group) {
+    int report[2];
+    struct clone_args args;
+
+    if (group->no_clone3) {
+        int error = posix_spawn(pid, path, actions, attr, arguments, environ);
+        if (error == 0 && (error = limit_spawned(*pid, group)) != 0) {
+            kill(*pid, SIGKILL); // reaped by reap_children, as it's in no job
+        }
+        return error;
+    }
+    if (pipe2(report, O_CLOEXEC) == -1) {
+        return errno;
+    }
+    memset(&args, 0, sizeof(args));
+    args.flags = CLONE_VFORK | (group->cgroup_fd != -1 ? CLONE_INTO_CGROUP : 0);
+    args.exit_signal = SIGCHLD;
+    args.cgroup = group->cgroup_fd != -1 ? (uint64_t)group->cgroup_fd : 0;
+
+    long child = syscall(SYS_clone3, &args, sizeof(args));
+    if (child == 0) {
+        exec_in_group(path, arguments, fds, background, group);
+        int error = errno;
+        if (write(report[1], &error, sizeof(error)) != sizeof(error)) {
+            _exit(127);
+        }
+        _exit(127);
+    }
+    int error = child == -1 ? errno : 0;
+    close(report[1]);
+    if (error == ENOSYS || error == EINVAL || error == EPERM) {
+        close(report[0]);
+        limit_without_cgroup(group);
+        return spawn_in_group(pid, path, actions, attr, arguments, fds, background, group);
+    }
+    if (child != -1 && read(report[0], &error, sizeof(error)) != sizeof(error)) {
+        error = 0; // closed by the execve
+    }
+    close(report[0]);
+    if (error == 0) {
+        *pid = (pid_t)child;
+    }
+    // a child that failed is still reaped, by reap_children, as it's in no job
+    return error;
+}
+
+// posix_spawn, or spawn_in_group while "limit" runs a command
+int start_process(pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions,
+                  const posix_spawnattr_t* attr, char** arguments, const int fds[3], int background) {
+    if (current_group != NULL) {
+        return spawn_in_group(pid, path, actions, attr, arguments, fds, background, current_group);
+    }
+    return posix_spawn(pid, path, actions, attr, arguments, environ);
+}
+
+// start arguments with in_fd as its stdin and out_fd as its stdout (-1 keeps the shell's), unless its own
+// redirections replace them. returns the child's pid, or -1 after reporting the failure. a command that can't be
+// executed is reported here, by the shell, as the child never gets to run
+pid_t spawn_command(char** arguments, int in_fd, int out_fd, int background) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+    int status;
+    int files[3];
+
+    if (open_redirections(arguments, files) != 0) {
+        last_status = 1;
+        return -1;
+    }
+    if (arguments[0] == NULL || posix_spawn_file_actions_init(&actions) != 0) {
+        fprintf(stderr, "%s", "Error in child\n");
+        close_redirections(files);
+        return -1;
+    }
+    in_fd = files[0] != -1 ? files[0] : in_fd;
+    out_fd = files[1] != -1 ? files[1] : out_fd;
+    // the descriptors the shell passes are close-on-exec, only their copies on 0, 1 and 2 reach the command
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+    }
+    if (files[2] != -1) {
+        posix_spawn_file_actions_adddup2(&actions, files[2], 2);
+    }
+
+    int fds[3] = {in_fd, out_fd, files[2]};
+    struct timespec started, spawned;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    const posix_spawnattr_t* attr = background ? &background_attr : &foreground_attr;
+    const char* path = resolve_command(arguments[0]);
+    status = path != NULL ? start_process(&pid, path, &actions, attr, arguments, fds, background) : ENOENT;
+    if (status == ENOENT && path != NULL && path != arguments[0]) {
+        // the cached binary is gone, look for it again
+        struct command_path* command = find_command(arguments[0], hash_name(arguments[0]));
+        if (command != NULL) {
+            remove_command(command);
+        }
+        path = resolve_command(arguments[0]);
+        status = path != NULL ? start_process(&pid, path, &actions, attr, arguments, fds, background) : ENOENT;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &spawned);
+    posix_spawn_file_actions_destroy(&actions);
+    close_redirections(files);
+    if (status != 0) {
+        fprintf(stderr, "%s", "Error in child\n");
+        last_status = 127;
+        return -1;
+    }
+
+    struct job* job = add_job(pid);
+    if (job == NULL) { // still reaped by reap_children, only not reported
+        return pid;
+    }
+    job->background = background;
+    job->started = started;
+    job->spawn_ns = (spawned.tv_sec - started.tv_sec) * 1000000000L + (spawned.tv_nsec - started.tv_nsec);
+    strncpy(job->name, arguments[0], JOB_NAME_SIZE - 1);
+    if (current_group != NULL) {
+        job->group = current_group;
+        current_group->live++;
+    }
+    return pid;
+}
+
+// wait for a foreground child, reaping the background ones that finish meanwhile. its status becomes last_status
+int wait_child(pid_t pid) {
+    struct pollfd child = {child_fd, POLLIN, 0};
+
+    while (1) {
+        reap_children();
+        struct job* job = find_job(pid);
+        if (job == NULL) { // not in the table, so reap_children already collected it
+            return 1;
+        }
+        if (job->done) {
+            last_status = exit_code(job->status);
+            remove_job(job);
+            return 1;
+        }
+        if (poll(&child, 1, -1) == -1 && errno != EINTR) {
+            fprintf(stderr, "%s", "Error in child\n");
+            return 0;
+        }
+    }
+}
+
+// single process in background
+int run_in_background(char** arguments, int ampersand_index) {
+
+    arguments[ampersand_index] = NULL;
+    spawn_command(arguments, -1, -1, 1);
+    return 1;
+}
+
+// copy what is left of in_fd to out_fd with read and write, when splice can't be used
+int copy_stage(int in_fd, int out_fd, int tee_fd) {
+    static __thread char buffer[1 << 16];
+    ssize_t got;
+
+    while ((got = read(in_fd, buffer, sizeof(buffer))) != 0) {
+        if (got == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (ssize_t done = 0; done < got; ) {
+            ssize_t put = write(out_fd, buffer + done, got - done);
+            if (put == -1 && errno != EINTR) {
+                return -1;
+            }
+            done += put > 0 ? put : 0;
+        }
+        if (tee_fd != -1 && write(tee_fd, buffer, got) != got) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void* run_splice_stage(void* arg) {
+    struct splice_stage* stage = arg;
+    int result = 0;
+    int started = 0; // bytes went out already, copy_stage would send them a second time
+
+    while (1) {
+        ssize_t moved;
+        if (stage->tee_fd != -1) {
+            // duplicate the data onto the output pipe, then move the same bytes out of the input into the file
+            moved = tee(stage->in_fd, stage->out_fd, SPLICE_CHUNK, 0);
+            for (ssize_t done = 0; moved > 0 && done < moved; ) {
+                ssize_t put = splice(stage->in_fd, NULL, stage->tee_fd, NULL, moved - done, SPLICE_F_MOVE);
+                if (put == -1 && errno == EINTR) { // the bytes are on the output pipe already, tee them only once
+                    continue;
+                }
+                if (put <= 0) {
+                    errno = put == 0 ? EIO : errno;
+                    moved = -1;
+                    started = 1;
+                    break;
+                }
+                done += put;
+            }
+        } else {
+            moved = splice(stage->in_fd, NULL, stage->out_fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE);
+        }
+
+        if (moved == 0) {
+            break;
+        }
+        if (moved == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && !started) { // an end isn't a pipe (or can't be spliced), move it all by hand
+                result = copy_stage(stage->in_fd, stage->out_fd, stage->tee_fd);
+            } else {
+                result = -1;
+            }
+            break;
+        }
+        started = 1;
+    }
+
+    if (result == -1 && errno != EPIPE) {
+        fprintf(stderr, "%s", "Error in splice\n");
+    }
+    // the stage owns its descriptors, closing them lets its neighbours see EOF or EPIPE
+    if (stage->in_fd != 0) {
+        close(stage->in_fd);
+    }
+    if (stage->out_fd != 1) {
+        close(stage->out_fd);
+    }
+    if (stage->tee_fd != -1) {
+        close(stage->tee_fd);
+    }
+    return NULL;
+}
+
+// start a splice stage between in_fd and out_fd (-1 for the shell's own), or the files of its redirections.
+// on success the stage owns both
+int start_splice_stage(struct splice_stage* stage, char** arguments, int in_fd, int out_fd) {
+    int files[3];
+
+    if (open_redirections(arguments, files) != 0) {
+        return -1;
+    }
+    if (files[2] != -1) { // the stage reports on the shell's stderr
+        close(files[2]);
+        files[2] = -1;
+    }
+    stage->in_fd = files[0] != -1 ? files[0] : in_fd != -1 ? in_fd : 0;
+    stage->out_fd = files[1] != -1 ? files[1] : out_fd != -1 ? out_fd : 1;
+    stage->tee_fd = -1;
+
+    if (arguments[1] != NULL) {
+        stage->tee_fd = open(arguments[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    }
+    if ((arguments[1] != NULL && stage->tee_fd == -1) ||
+        pthread_create(&stage->thread, NULL, run_splice_stage, stage) != 0) {
+        fprintf(stderr, "%s", "Error in splice\n");
+        if (stage->tee_fd != -1) {
+            close(stage->tee_fd);
+        }
+        close_redirections(files);
+        return -1;
+    }
+    // the pipe ends that redirections replaced aren't the stage's, they are closed here
+    if (files[0] != -1 && in_fd != -1) {
+        close(in_fd);
+    }
+    if (files[1] != -1 && out_fd != -1) {
+        close(out_fd);
+    }
+    return 0;
+}
+
+// where the inputs of "parallel" come from: the lines of file, or the words after ":::"
+struct parallel_inputs {
+    FILE* file;
+    char** words;
+    char* line;
+    size_t line_size;
+};
+
+// the next input, or NULL when there are no more
+char* next_input(struct parallel_inputs* inputs) {
+    if (inputs->file == NULL) {
+        return *inputs->words != NULL ? *inputs->words++ : NULL;
+    }
+    ssize_t length = getline(&inputs->line, &inputs->line_size, inputs->file);
+    if (length == -1) {
+        return NULL;
+    }
+    if (length > 0 && inputs->line[length - 1] == '\n') {
+        inputs->line[length - 1] = '\0';
+    }
+    return inputs->line;
+}
+
+// start the template with every "{}" in it replaced by input, or with input appended when it has none
+pid_t spawn_instance(char** template, int template_count, const char* input) {
+    char** argv = malloc(sizeof(char*) * (template_count + 2));
+    char** owned = calloc(template_count, sizeof(char*)); // arguments built for this instance
+    int used = 0;
+    pid_t pid = -1;
+
+    if (argv == NULL || owned == NULL) {
+        fprintf(stderr, "%s", "Error in parallel\n");
+        free(argv);
+        free(owned);
+        return -1;
+    }
+    size_t input_length = strlen(input);
+    for (int i = 0; i < template_count; i++) {
+        char* place = strstr(template[i], "{}");
+        argv[i] = template[i];
+        if (place == NULL) {
+            continue;
+        }
+        used = 1;
+        size_t length = strlen(template[i]);
+        for (char* p = place; p != NULL; p = strstr(p + 2, "{}")) {
+            length += input_length - 2;
+        }
+        owned[i] = malloc(length + 1);
+        if (owned[i] == NULL) {
+            fprintf(stderr, "%s", "Error in parallel\n");
+            goto out;
+        }
+        char* out = owned[i];
+        const char* from = template[i];
+        for (char* p = place; p != NULL; p = strstr(p + 2, "{}")) {
+            memcpy(out, from, p - from);
+            out += p - from;
+            memcpy(out, input, input_length);
+            out += input_length;
+            from = p + 2;
+        }
+        strcpy(out, from);
+        argv[i] = owned[i];
+    }
+    argv[template_count] = used ? NULL : (char*)input;
+    argv[template_count + 1] = NULL;
+    // posix_spawn returns once the child has executed, the arguments can go right after
+    pid = spawn_command(argv, -1, -1, 0);
+out:
+    for (int i = 0; i < template_count; i++) {
+        free(owned[i]);
+    }
+    free(owned);
+    free(argv);
+    return pid;
+}
+
+// "parallel [-j jobs] [-a file] command ... [::: input ...]" runs command once per input with at most jobs
+// (the number of CPUs by default) children at once. per job timings and the total throughput go to stderr
+int run_parallel(char** arguments, int count) {
+    long limit = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* input_file = NULL;
+    struct parallel_inputs inputs = {NULL, NULL, NULL, 0};
+    int i = 1;
+
+    for (; i + 1 < count && arguments[i][0] == '-'; i += 2) {
+        if (strcmp(arguments[i], "-j") == 0) {
+            limit = atol(arguments[i + 1]);
+        } else if (strcmp(arguments[i], "-a") == 0) {
+            input_file = arguments[i + 1];
+        } else {
+            break;
+        }
+    }
+    char** template = arguments + i;
+    int template_count = 0;
+    while (i + template_count < count && strcmp(template[template_count], ":::") != 0) {
+        template_count++;
+    }
+    int has_words = i + template_count < count;
+    if (limit < 1 || template_count == 0 || has_words == (input_file != NULL)) {
+        fprintf(stderr, "%s", "Error in parallel\n");
+        return 1;
+    }
+    if (has_words) {
+        inputs.words = template + template_count + 1;
+    } else if ((inputs.file = fopen(input_file, "re")) == NULL) {
+        fprintf(stderr, "%s", "Error in parallel\n");
+        return 1;
+    }
+
+    struct pollfd child = {child_fd, POLLIN, 0};
+    pid_t* running = malloc(sizeof(pid_t) * limit);
+    long active = 0;
+    long finished = 0;
+    long failed = 0;
+    struct timespec start, end;
+    char* input = NULL;
+
+    if (running == NULL) {
+        fprintf(stderr, "%s", "Error in parallel\n");
+        if (inputs.file != NULL) {
+            fclose(inputs.file);
+        }
+        return 1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (1) {
+        while (active < limit && (input = next_input(&inputs)) != NULL) {
+            pid_t pid = spawn_instance(template, template_count, input);
+            if (pid == -1) {
+                failed++;
+            } else {
+                running[active++] = pid;
+            }
+        }
+        if (active == 0) {
+            break;
+        }
+
+        reap_children();
+        int completed = 0;
+        for (long j = 0; j < active; j++) {
+            struct job* job = find_job(running[j]);
+            if (job != NULL && !job->done) {
+                continue;
+            }
+            if (job != NULL) {
+                int ok = WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0;
+                fprintf(stderr, "parallel: [%d] %s %.3fs user %ld.%06lds sys %ld.%06lds\n", job->pid,
+                        ok ? "done" : "failed", seconds_between(&job->started, &job->ended),
+                        (long)job->usage.ru_utime.tv_sec, (long)job->usage.ru_utime.tv_usec,
+                        (long)job->usage.ru_stime.tv_sec, (long)job->usage.ru_stime.tv_usec);
+                failed += !ok;
+                remove_job(job);
+            }
+            finished++;
+            completed = 1;
+            running[j--] = running[--active];
+        }
+        if (!completed && poll(&child, 1, -1) == -1 && errno != EINTR) {
+            fprintf(stderr, "%s", "Error in parallel\n");
+            break;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double elapsed = seconds_between(&start, &end);
+    fprintf(stderr, "parallel: %ld jobs (%ld failed) in %.3fs, %.1f jobs/s with %ld at once\n", finished, failed,
+            elapsed, elapsed > 0 ? finished / elapsed : 0.0, limit);
+    free(running);
+    if (inputs.file != NULL) {
+        free(inputs.line);
+        fclose(inputs.file);
+    }
+    last_status = failed != 0;
+    return 1;
+}
+
+int run_command(int count, char** arguments);
+
+// the value of a numeric option of "limit", from 1 to max. -1 if it isn't just a number in that range
+long parse_limit(const char* text, long max) {
+    char* end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    return errno != 0 || end == text || *end != '\0' || value < 1 || value > max ? -1 : value;
+}
+
+// "limit [-c cpu_percent] [-m bytes[K|M|G]] [-i io_weight] [-t cpu_seconds] command ..." runs command, which
+// may be a pipeline or a background job, as a job group with those limits
+int run_limited(char** arguments, int count) {
+    int cpu_percent = 0;
+    long long memory = 0;
+    int io_weight = 0;
+    long cpu_seconds = 0;
+    int i = 1;
+
+    for (; i + 1 < count && arguments[i][0] == '-'; i += 2) {
+        char* unit;
+        if (strcmp(arguments[i], "-c") == 0) {
+            cpu_percent = (int)parse_limit(arguments[i + 1], INT_MAX);
+        } else if (strcmp(arguments[i], "-m") == 0) {
+            errno = 0;
+            memory = strtoll(arguments[i + 1], &unit, 10);
+            int shift = *unit == 'K' ? 10 : *unit == 'M' ? 20 : *unit == 'G' ? 30 : 0;
+            // only one of the suffixes may follow the number, and the bytes must fit
+            if (errno != 0 || memory < 0 || unit == arguments[i + 1] || unit[shift != 0] != '\0' || memory > LLONG_MAX >> shift) {
+                memory = -1;
+            } else {
+                memory <<= shift;
+            }
+        } else if (strcmp(arguments[i], "-i") == 0) {
+            io_weight = (int)parse_limit(arguments[i + 1], 10000); // the io.weight range, mapped onto the ioprio levels
+        } else if (strcmp(arguments[i], "-t") == 0) {
+            cpu_seconds = parse_limit(arguments[i + 1], LONG_MAX);
+        } else {
+            break;
+        }
+    }
+    if (i == count || cpu_percent < 0 || memory < 0 || io_weight < 0 || cpu_seconds < 0) {
+        fprintf(stderr, "%s", "Error in limit\n");
+        last_status = 1;
+        return 1;
+    }
+
+    struct job_group* group = create_group(cpu_percent, memory, io_weight, cpu_seconds, arguments[i]);
+    if (group == NULL) {
+        fprintf(stderr, "%s", "Error in limit\n");
+        last_status = 1;
+        return 1;
+    }
+    struct job_group* outer = current_group;
+    current_group = group;
+    int return_value = run_command(count - i, arguments + i);
+    current_group = outer;
+    release_group(group);
+    return return_value;
+}
+
+// pipeline of any number of commands separated by "|", all of them running at once.
+// the shell holds at most the two ends of the pipe being connected, and closes them as soon as they are handed out
+int run_with_child(char** arguments, int count) {
+
+    int stages = 1;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(arguments[i], "|") == 0) {
+            stages++;
+        }
+    }
+
+    pid_t* pids = malloc(sizeof(pid_t) * stages);
+    struct splice_stage* splices = malloc(sizeof(struct splice_stage) * stages);
+    int* is_splice = calloc(stages, sizeof(int)); // whether the stage runs in splices instead of a child
+    if (pids == NULL || splices == NULL || is_splice == NULL) {
+        fprintf(stderr, "%s", "Error in pipe\n");
+        free(pids);
+        free(splices);
+        free(is_splice);
+        return 0;
+    }
+
+    char** command = arguments;
+    int file_reader = -1; // read end of the previous stage's pipe
+    int started = 0;
+    int return_value = 1;
+
+    for (int stage = 0; stage < stages; stage++) {
+        char** next_command = NULL;
+        int file_args[2] = {-1, -1};
+
+        if (stage < stages - 1) {
+            int symbol = 0;
+            while (strcmp(command[symbol], "|") != 0) {
+                symbol++;
+            }
+            command[symbol] = NULL;
+            next_command = command + symbol + 1;
+
+            if (pipe2(file_args, O_CLOEXEC) == -1) {
+                fprintf(stderr, "%s", "Error in pipe\n");
+                return_value = 0;
+                break;
+            }
+            if (pipe_size > 0) {
+                // the size is capped by /proc/sys/fs/pipe-max-size for unprivileged users, keep the default then
+                fcntl(file_args[1], F_SETPIPE_SZ, pipe_size);
+            }
+        }
+
+        pids[started] = -1;
+        if (command[0] == NULL) { // "|" with no command on one of its sides
+            fprintf(stderr, "%s", "Error in pipe\n");
+        } else if (strcmp(command[0], "splice") == 0) {
+            is_splice[started] = start_splice_stage(&splices[started], command, file_reader, file_args[1]) == 0;
+        } else {
+            pids[started] = spawn_command(command, file_reader, file_args[1], 0);
+        }
+
+        if (!is_splice[started]) {
+            if (file_reader != -1) {
+                close(file_reader);
+            }
+            if (file_args[1] != -1) {
+                close(file_args[1]);
+            }
+        }
+        started++;
+        file_reader = file_args[0];
+        command = next_command;
+    }
+    if (file_reader != -1) {
+        close(file_reader);
+    }
+
+    for (int stage = 0; stage < started; stage++) {
+        if (pids[stage] != -1 && !wait_child(pids[stage])) {
+            return_value = 0;
+        }
+        if (is_splice[stage]) {
+            pthread_join(splices[stage].thread, NULL);
+        }
+    }
+    free(pids);
+    free(splices);
+    free(is_splice);
+    return return_value;
+}
+
+// a single command, pipeline, background or redirected command, without ";", "&&" or "||"
+int run_command(int count, char** arguments) {
+
+    int return_value = 0;
+    last_status = 0; // built ins and background jobs succeed unless they say otherwise
+    if (count == 1 && strcmp(arguments[0], "jobs") == 0) {
+        return list_jobs();
+    }
+    if (strcmp(arguments[0], "hash") == 0) {
+        return run_hash(arguments, count);
+    }
+    if (strcmp(arguments[0], "parallel") == 0) {
+        return run_parallel(arguments, count);
+    }
+    if (strcmp(arguments[0], "limit") == 0) {
+        return run_limited(arguments, count);
+    }
+
+    int special_char_index = -1;
+	for (int i = 0; i < count; i++) {
+        if (strcmp(arguments[i], "&") == 0) {
+            special_char_index = i;
+			break;
+        }
+        if (strcmp(arguments[i], "|") == 0) {
+            special_char_index = i;
+			break;
+        }
+    }
+    // the splice stage is built in, a pipeline of one runs it in the shell
+    if (special_char_index == -1 && strcmp(arguments[0], "splice") == 0) {
+        return run_with_child(arguments, count);
+    }
+    // symbols "&", "|" not found, redirections are handled by spawn_command
+	if (special_char_index == -1) {
+		pid_t pid = spawn_command(arguments, -1, -1, 0);
+		return_value = pid == -1 || wait_child(pid);
+	} else {
+		// pipe
+        if(strcmp(arguments[special_char_index], "|") == 0) {
+            return_value = run_with_child(arguments, count);
+        }
+        // run in background
+        else {
+            return_value = run_in_background(arguments, special_char_index);
+        }
+    } 
+    return return_value;
+}
+
+// commands separated by ";" or "&" run one after the other (the ones ending with "&" in the background).
+// after "&&" the next one runs only if the last one succeeded, and after "||" only if it failed. a command
+// that is skipped keeps the last status, as in sh
+int process_arglist(int count, char** arguments) {
+    reap_children();
+
+    int run = 1;
+    int start = 0;
+    for (int i = 0; i <= count; i++) {
+        int end = i == count;
+        if (!end && strcmp(arguments[i], ";") != 0 && strcmp(arguments[i], "&") != 0 &&
+            strcmp(arguments[i], "&&") != 0 && strcmp(arguments[i], "||") != 0) {
+            continue;
+        }
+
+        char* separator = end ? NULL : arguments[i];
+        int length = i - start;
+        if (separator != NULL && strcmp(separator, "&") == 0) {
+            length++; // run_command sees the "&" and replaces it with the end of the arguments
+        } else {
+            arguments[i] = NULL;
+        }
+        if (run && i > start && !run_command(length, arguments + start)) {
+            return 0;
+        }
+        if (separator != NULL) {
+            run = strcmp(separator, "&&") != 0 && strcmp(separator, "||") != 0 ?
+                  1 : (strcmp(separator, "&&") == 0) == (last_status == 0);
+        }
+        start = i + 1;
+    }
+    return 1;
+}
+
+int finalize(void) {
+    reap_children();
+    free(jobs);
+    jobs = NULL;
+    jobs_capacity = 0;
+    jobs_count = 0;
+    close(child_fd);
+    forget_commands();
+    if (trace != NULL) {
+        fclose(trace);
+    }
+    if (cgroup_root[0] != '\0') {
+        rmdir(cgroup_root); // fails while limited background jobs are still running, they keep it
+    }
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,46 @@
+#!/bin/sh
+# parse throughput of the shell.c read loop, with a process_arglist that only counts the words so no command runs.
+# usage: ./parse_bench.sh [lines]
+set -e
+
+LINES=${1:-2000000}
+DIR=$(dirname "$0")
+BIN=$(mktemp -d)
+trap 'rm -rf "$BIN"' EXIT
+
+cat > "$BIN/stub.c" <<'STUB'
+#include <stdio.h>
+
+static long words;
+static long lines;
+
+int process_arglist(int count, char** arglist) {
+    words += count;
+    lines++;
+    return arglist[count] == NULL;
+}
+
+int prepare(void) {
+    return 0;
+}
+
+int finalize(void) {
+    fprintf(stderr, "%ld lines, %ld words\n", lines, words);
+    return 0;
+}
+STUB
+gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 "$DIR/shell.c" "$BIN/stub.c" -o "$BIN/parse"
+
+# a mix of plain, quoted and escaped words like the ones of our job scripts
+awk -v n="$LINES" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf "run --input /data/part-%d.csv \"--label=batch %d\" out\\ %d | sort -k2 > result.%d\n", i, i, i, i
+}' > "$BIN/input"
+
+bytes=$(wc -c < "$BIN/input")
+start=$(date +%s%N)
+"$BIN/parse" < "$BIN/input"
+end=$(date +%s%N)
+ms=$(( (end - start) / 1000000 ))
+[ "$ms" -gt 0 ] || ms=1
+echo "$LINES lines ($bytes bytes) in $ms ms, $(( LINES / ms * 1000 )) lines/s, $(( bytes / 1000 / ms )) MB/s"
@@ -0,0 +1,41 @@
+#!/bin/sh
+# throughput of data pushed through pipelines of growing length built by myshell,
+# once with cat in the middle stages and once with the built in splice stage.
+# the pipe capacity comes from MYSHELL_PIPE_SIZE as in the shell (e.g. 1048576).
+# usage: ./pipeline_bench.sh [megabytes] [max stages]
+set -e
+
+MB=${1:-1024}
+MAX_STAGES=${2:-16}
+DIR=$(dirname "$0")
+BIN=$(mktemp -d)
+trap 'rm -rf "$BIN"' EXIT
+
+gcc -O3 -D_POSIX_C_SOURCE=200809 -Wall -std=c11 "$DIR/shell.c" "$DIR/myshell.c" -o "$BIN/myshell"
+
+# runs one command line through the shell and prints its wall time in ms
+run() {
+	start=$(date +%s%N)
+	echo "$1" | "$BIN/myshell" > /dev/null
+	end=$(date +%s%N)
+	echo $(( (end - start) / 1000000 ))
+}
+
+echo "pipe size: ${MYSHELL_PIPE_SIZE:-default}"
+for middle in cat splice; do
+	stages=2
+	while [ "$stages" -le "$MAX_STAGES" ]; do
+		line="head -c ${MB}M /dev/zero"
+		i=2
+		while [ "$i" -lt "$stages" ]; do
+			line="$line | $middle"
+			i=$((i + 1))
+		done
+		line="$line | wc -c"
+
+		ms=$(run "$line")
+		[ "$ms" -gt 0 ] || ms=1
+		echo "$stages stages ($middle): $MB MB in $ms ms, $(awk "BEGIN { printf \"%.2f\", $MB / 1024 / ($ms / 1000) }") GB/s"
+		stages=$((stages * 2))
+	done
+done
@@ -3,6 +3,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
@@ -13,52 +15,150 @@ int process_arglist(int count, char** arglist);
 int prepare(void);
 int finalize(void);
 
-int main(void)
+#define READ_BUFFER_SIZE (1 << 20) // bytes read from the input at once
+#define MIN_ARGS 16
+
+// the input is read in large blocks into a buffer that is reused for every line, and grown (doubled) only when
+// a single line doesn't fit. lines are split in place, so a line costs no allocation at all
+struct reader
 {
-	if (prepare() != 0)
-		exit(1);
-	
-	while (1)
-	{
-		char** arglist = NULL;
-		char* line = NULL;
-		size_t size;
-		int count = 0;
+	int fd;
+	char* buffer;
+	size_t size;
+	size_t start; // first byte not handed out yet
+	size_t end; // end of the bytes read
+};
 
-		if (getline(&line, &size, stdin) == -1) {
-			free(line);
-			break;
+// the next line, without its newline and terminated by '\0'. NULL at the end of the input
+char* read_line(struct reader* reader)
+{
+	while (1) {
+		char* newline = memchr(reader->buffer + reader->start, '\n', reader->end - reader->start);
+		if (newline != NULL) {
+			char* line = reader->buffer + reader->start;
+			*newline = '\0';
+			reader->start = newline + 1 - reader->buffer;
+			return line;
 		}
-    
-		arglist = (char**) malloc(sizeof(char*));
-		if (arglist == NULL) {
-			printf("malloc failed: %s\n", strerror(errno));
-			exit(1);
+
+		// keep the partial line at the front of the buffer and read after it
+		memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+		reader->end -= reader->start;
+		reader->start = 0;
+		if (reader->end + 1 >= reader->size) {
+			reader->size *= 2;
+			reader->buffer = (char*) realloc(reader->buffer, reader->size);
+			if (reader->buffer == NULL) {
+				printf("realloc failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+
+		ssize_t got = read(reader->fd, reader->buffer + reader->end, reader->size - reader->end - 1);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (reader->end == 0)
+				return NULL;
+			// the last line has no newline
+			reader->buffer[reader->end] = '\0';
+			reader->start = reader->end;
+			return reader->buffer;
 		}
-		arglist[0] = strtok(line, " \t\n");
-    
-		while (arglist[count] != NULL) {
-			++count;
-			arglist = (char**) realloc(arglist, sizeof(char*) * (count + 1));
-			if (arglist == NULL) {
+		reader->end += got;
+	}
+}
+
+// split line in place into words separated by spaces and tabs, storing them in *args (grown as needed, so it
+// only allocates for the longest line). '...' is taken literally, "..." and the rest of the line honour
+// backslash escapes. RETURNS - the number of words, or -1 for an unterminated quote
+int split_line(char* line, char*** args, size_t* capacity)
+{
+	char* in = line;
+	char* out = line; // words are compacted over the quotes and backslashes they drop
+	int count = 0;
+
+	while (1) {
+		while (*in == ' ' || *in == '\t')
+			in++;
+		if (*in == '\0')
+			break;
+
+		if ((size_t)count + 1 >= *capacity) {
+			*capacity *= 2;
+			*args = (char**) realloc(*args, sizeof(char*) * *capacity);
+			if (*args == NULL) {
 				printf("realloc failed: %s\n", strerror(errno));
 				exit(1);
 			}
-      
-			arglist[count] = strtok(NULL, " \t\n");
 		}
-    
-		if (count != 0) {
-			if (!process_arglist(count, arglist)) {
-				free(line);
-				free(arglist);
-				break;
+		(*args)[count++] = out;
+
+		char quote = '\0';
+		while (*in != '\0' && (quote != '\0' || (*in != ' ' && *in != '\t'))) {
+			char c = *in++;
+			if (quote == '\0' && (c == '\'' || c == '"')) {
+				quote = c;
+			} else if (c == quote) {
+				quote = '\0';
+			} else if (c == '\\' && quote != '\'' && *in != '\0' && (quote == '\0' || *in == '"' || *in == '\\')) {
+				*out++ = *in++;
+			} else {
+				*out++ = c;
 			}
 		}
-    
-		free(line);
-		free(arglist);
+		if (quote != '\0')
+			return -1;
+		// the separator (or the end of the line) was read, so this never overwrites unread input
+		if (*in != '\0')
+			in++;
+		*out++ = '\0';
+	}
+	(*args)[count] = NULL;
+	return count;
+}
+
+// with an argument, the commands are read from that script instead of the standard input
+int main(int argc, char** argv)
+{
+	struct reader reader = {0, NULL, READ_BUFFER_SIZE, 0, 0};
+	size_t capacity = MIN_ARGS;
+	char** arglist = (char**) malloc(sizeof(char*) * capacity);
+	char* line;
+
+	if (argc > 1) {
+		reader.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (reader.fd == -1) {
+			printf("open failed: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	reader.buffer = (char*) malloc(reader.size);
+	if (arglist == NULL || reader.buffer == NULL) {
+		printf("malloc failed: %s\n", strerror(errno));
+		exit(1);
 	}
+
+	if (prepare() != 0)
+		exit(1);
+	
+	while ((line = read_line(&reader)) != NULL)
+	{
+		int count = split_line(line, &arglist, &capacity);
+
+		if (count == -1) {
+			fprintf(stderr, "unterminated quote\n");
+			continue;
+		}
+		if (count != 0 && !process_arglist(count, arglist))
+			break;
+	}
+
+	free(reader.buffer);
+	free(arglist);
+	if (reader.fd != 0)
+		close(reader.fd);
 	
 	if (finalize() != 0)
 		exit(1);
@@ -14,6 +14,7 @@
 #include <fcntl.h>
 
 #define BUFFER_SIZE 1024
+#define BYTE_VALUES 256
 
 // send exactly count bytes from buffer over the socket represented by sockfd
 // returns negative value on error and errno will be set (by the write syscall), returns 0 otherwise
@@ -37,7 +38,8 @@ int sendall(int sockfd, char * buffer, size_t count)
 }
 
 // read exactly count bytes into buffer from the socket represented by sockfd
-// returns negative value on error and errno will be set (by the read syscall), returns 0 otherwise
+// returns negative value on error and errno will be set (by the read syscall), returns 1 if the server closed
+// the connection before sending count bytes, returns 0 otherwise
 int readall(int sockfd, char * buffer, size_t count)
 {
 	char * remaining_start = buffer;
@@ -50,6 +52,10 @@ int readall(int sockfd, char * buffer, size_t count)
 		{
 			return bytes_read;
 		}
+		if (bytes_read == 0) // the connection was closed, no more bytes will come
+		{
+			return 1;
+		}
 
 		remaining_start += bytes_read;
 		remaining_count -= bytes_read;
@@ -60,11 +66,17 @@ int readall(int sockfd, char * buffer, size_t count)
 // code partially based on networks recitation code
 int main(int argc, char *argv[])
 {
-	if (argc != 4)
+	if (argc != 4 && argc != 5)
 	{
 		fprintf(stderr, "wrong number of arguments\n");
 		return 1;
 	}
+	// -x asks for the extended reply, the server must be running with -x as well
+	if (argc == 5 && strcmp(argv[4], "-x") != 0)
+	{
+		fprintf(stderr, "unknown option %s\n", argv[4]);
+		return 1;
+	}
 
 	struct sockaddr_in serv_addr;
 	int	sockfd = -1;
@@ -74,6 +86,7 @@ int main(int argc, char *argv[])
 	uint32_t N_network;
 	int finished_reading = 0;
 	uint32_t C_network;
+	uint32_t extended_network[1 + BYTE_VALUES]; // CRC32C followed by the byte histogram
 
 	if( (filefd = open(argv[3], O_RDONLY)) < 0)
 	{
@@ -140,13 +153,44 @@ int main(int argc, char *argv[])
 	}
 
 	// read the amount of printable characters as counted by the server (in network byte order) and print it
-	if (readall(sockfd, (char *) &C_network, sizeof(C_network)) < 0)
+	int status = readall(sockfd, (char *) &C_network, sizeof(C_network));
+	if (status < 0)
 	{
 		perror("error in reading printable characters count C");
 		return 1;
 	}
+	if (status > 0)
+	{
+		fprintf(stderr, "server closed the connection before sending C\n");
+		return 1;
+	}
 	printf("# of printable characters: %u\n", ntohl(C_network));
 
+	if (argc == 5)
+	{
+		// a server without -x closes the connection right after C, the request can't tell it which reply we want
+		status = readall(sockfd, (char *) extended_network, sizeof(extended_network));
+		if (status < 0)
+		{
+			perror("error in reading extended reply");
+			return 1;
+		}
+		if (status > 0)
+		{
+			fprintf(stderr, "server did not send an extended reply (is it running with -x?)\n");
+			return 1;
+		}
+		printf("CRC32C: %08x\n", ntohl(extended_network[0]));
+		for (int i = 0; i < BYTE_VALUES; i++)
+		{
+			uint32_t count = ntohl(extended_network[1 + i]);
+			if (count > 0)
+			{
+				printf("byte 0x%02x: %u\n", i, count);
+			}
+		}
+	}
+
 	close(sockfd);
 	close(filefd);
 	return 0;
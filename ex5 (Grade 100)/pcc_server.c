@@ -1,3 +1,7 @@
+#ifdef PCC_IO_URING
+#define _GNU_SOURCE // for syscall() and the io_uring system calls
+#endif
+
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -10,10 +14,19 @@
 #include <stdint.h>
 #include <signal.h>
 
+#ifdef PCC_IO_URING
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
 #define BUFFER_SIZE 1024
 #define PRINTABLE_START 32
 #define PRINTABLE_END 126
 #define PRINTABLE_COUNT (PRINTABLE_END - PRINTABLE_START + 1)
+#define BYTE_VALUES 256
+#define CRC32C_POLY 0x82F63B78 // reflected Castagnoli polynomial
+#define EXTENDED_REPLY_WORDS (2 + BYTE_VALUES) // C, CRC32C and the full byte histogram
 
 int sigint_happened = 0; // global flag to signify a SIGINT happened and the server needs to be stopped
 
@@ -72,17 +85,125 @@ int readall(int sockfd, char * buffer, size_t count)
 	return 0;
 }
 
-// serve a specific client through connfd, updating pcc_total as needed
+// count printable characters in buffer, updating the per-character counts in pcc_local
+// returns the number of printable characters found
+uint32_t count_printable(const char * buffer, size_t count, uint32_t *pcc_local)
+{
+	uint32_t printable = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (buffer[i] >= PRINTABLE_START && buffer[i] <= PRINTABLE_END) // buffer[i] is printable
+		{
+			printable++; // update count of all printable characters
+			pcc_local[buffer[i] - PRINTABLE_START]++; // update count of the specific character read
+		}
+	}
+	return printable;
+}
+
+uint32_t crc32c_table[BYTE_VALUES]; // lookup table of the software CRC32C, filled by crc32c_init
+
+void crc32c_init(void)
+{
+	for (uint32_t i = 0; i < BYTE_VALUES; i++)
+	{
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		}
+		crc32c_table[i] = crc;
+	}
+}
+
+#if defined(__x86_64__)
+// single pass over buffer using the SSE4.2 crc32 instruction, 8 bytes at a time
+// every loaded word is also used to update the histogram so the data is only read once
+__attribute__((target("sse4.2")))
+uint32_t count_extended_sse42(const unsigned char * buffer, size_t count, uint32_t crc, uint32_t *histogram)
+{
+	size_t i = 0;
+
+	for (; i + sizeof(uint64_t) <= count; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, buffer + i, sizeof(word));
+		crc = (uint32_t) __builtin_ia32_crc32di(crc, word);
+		for (int byte = 0; byte < (int) sizeof(word); byte++)
+		{
+			histogram[(word >> (8 * byte)) & 0xFF]++;
+		}
+	}
+	for (; i < count; i++)
+	{
+		crc = __builtin_ia32_crc32qi(crc, buffer[i]);
+		histogram[buffer[i]]++;
+	}
+	return crc;
+}
+#endif
+
+// update the running CRC32C *crc (kept inverted, start with ~0) and the full byte histogram with buffer
+// in a single pass, using the hardware crc32 instruction when the cpu has it
+void count_extended(const char * buffer, size_t count, uint32_t *crc, uint32_t *histogram)
+{
+	const unsigned char *bytes = (const unsigned char *) buffer;
+
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2"))
+	{
+		*crc = count_extended_sse42(bytes, count, *crc, histogram);
+		return;
+	}
+#endif
+	for (size_t i = 0; i < count; i++)
+	{
+		*crc = crc32c_table[(*crc ^ bytes[i]) & 0xFF] ^ (*crc >> 8);
+		histogram[bytes[i]]++;
+	}
+}
+
+// build the reply of a client into reply (in network order) and return its size in bytes
+// with a histogram (extended mode) C and pcc_local are taken from it, otherwise C_host was counted by count_printable
+size_t build_reply(uint32_t *reply, uint32_t C_host, uint32_t crc, const uint32_t *histogram, uint32_t *pcc_local)
+{
+	if (histogram == NULL)
+	{
+		reply[0] = htonl(C_host);
+		return sizeof(uint32_t);
+	}
+
+	C_host = 0;
+	for (int i = 0; i < PRINTABLE_COUNT; i++)
+	{
+		pcc_local[i] = histogram[PRINTABLE_START + i];
+		C_host += pcc_local[i];
+	}
+
+	reply[0] = htonl(C_host);
+	reply[1] = htonl(~crc); // final inversion of the CRC32C
+	for (int i = 0; i < BYTE_VALUES; i++)
+	{
+		reply[2 + i] = htonl(histogram[i]);
+	}
+	return EXTENDED_REPLY_WORDS * sizeof(uint32_t);
+}
+
+// serve a specific client through connfd, updating pcc_total (and byte_total in extended mode, otherwise it is NULL) as needed
 // returns 0 for success or non-fatal (TCP connection) errors, -1 for fatal errors
 // in both cases writes error descriptions to stderr
-int serve_client(int connfd, uint32_t *pcc_total)
+int serve_client(int connfd, uint32_t *pcc_total, uint32_t *byte_total)
 {
 	char data_buff[BUFFER_SIZE];
 	uint32_t C_host = 0; // count of printable characters in host order
-	uint32_t C_network; // count of printable characters in network order
+	uint32_t reply[EXTENDED_REPLY_WORDS]; // C (followed by the extended results) in network order
+	size_t reply_size;
 	uint32_t N_network; // will contain the number sent from client in network order
 	uint32_t remaining; // remaining bytes to read
 	uint32_t pcc_total_local[PRINTABLE_COUNT] = {0}; // init local counts with zeroe
+	uint32_t crc = ~0U; // running CRC32C of the file data (extended mode)
+	uint32_t byte_total_local[BYTE_VALUES] = {0}; // histogram of all byte values (extended mode)
 
 	// read 4 bytes representing N from the socket
 	if (readall(connfd, (char *) &N_network, sizeof(N_network)) < 0)
@@ -133,22 +254,21 @@ int serve_client(int connfd, uint32_t *pcc_total)
 
 		else // if we actually read something, count printable characters and decrease remaining counter
 		{
-			for (uint32_t i = 0; i < bytes_read; i++)
+			if (byte_total != NULL) // printable counts are derived from the histogram once all data was read
 			{
-				if (data_buff[i] >= PRINTABLE_START && data_buff[i] <= PRINTABLE_END) // data_buff[i] is printable
-				{
-					C_host++; // update count of all printable characters
-					pcc_total_local[data_buff[i] - PRINTABLE_START]++; // update count of the specific character read
-				}
+				count_extended(data_buff, bytes_read, &crc, byte_total_local);
+			}
+			else
+			{
+				C_host += count_printable(data_buff, bytes_read, pcc_total_local);
 			}
-
 			remaining -= bytes_read;
 		}
 	}
 
-	// convert C to network order and send it
-	C_network = htonl(C_host);
-	if (sendall(connfd, (char *) &C_network, sizeof(C_network)) < 0)
+	// convert C (and the extended results) to network order and send it
+	reply_size = build_reply(reply, C_host, crc, byte_total != NULL ? byte_total_local : NULL, pcc_total_local);
+	if (sendall(connfd, (char *) reply, reply_size) < 0)
 	{
 		// TCP error - print and return "success"
 		if (errno == ETIMEDOUT || errno == ECONNRESET || errno == EPIPE)
@@ -168,18 +288,568 @@ int serve_client(int connfd, uint32_t *pcc_total)
 	{
 		pcc_total[i] += pcc_total_local[i];
 	}
+	if (byte_total != NULL)
+	{
+		for (int i = 0; i < BYTE_VALUES; i++)
+		{
+			byte_total[i] += byte_total_local[i];
+		}
+	}
 
 	return 0;
 }
 
+#ifdef PCC_IO_URING
+// io_uring engine: a single ring drives every client concurrently. the listening socket is armed once with a
+// multishot accept, data is received into a ring of kernel-provided buffers and all queued requests (recv, send,
+// close) are submitted together with the wait for the next completions, so each loop iteration is one syscall.
+// compile with -DPCC_IO_URING to enable it; if the kernel lacks io_uring the blocking loop in main is used instead.
+
+#define URING_ENTRIES 256 // submission queue size
+#define URING_BUF_COUNT 512 // number of provided receive buffers (must be a power of 2)
+#define URING_BUF_SIZE 4096 // size of each provided receive buffer
+#define URING_BUF_GROUP 0 // buffer group id of the provided buffers
+
+// the operation a request belongs to is kept in the low bits of its user_data, next to the client pointer
+#define URING_OP_ACCEPT 0
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_CLOSE 3
+#define URING_OP_MASK 3ULL
+
+// state of a single client connection served by the io_uring engine
+struct uring_client
+{
+	int connfd;
+	uint32_t N_network; // the number sent from client in network order
+	uint32_t header_read; // how many bytes of N were read so far
+	uint32_t remaining; // remaining bytes of file data to read
+	uint32_t C_host; // count of printable characters in host order
+	uint32_t reply[EXTENDED_REPLY_WORDS]; // C (followed by the extended results) in network order, buffer of the outgoing send
+	uint32_t reply_size; // size of reply in bytes
+	uint32_t sent; // how many bytes of reply were sent so far
+	uint32_t pcc_total_local[PRINTABLE_COUNT]; // counts of this client, merged into pcc_total only after C was sent
+	uint32_t crc; // running CRC32C of the file data (extended mode)
+	uint32_t byte_total_local[BYTE_VALUES]; // histogram of all byte values (extended mode)
+};
+
+struct uring
+{
+	int ringfd;
+	char *sq_ring; // the mappings of the ring, NULL until made (cq_ring is sq_ring with IORING_FEAT_SINGLE_MMAP)
+	size_t sq_ring_size;
+	char *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned sq_local_tail; // tail of the entries we filled, published to the kernel before entering
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	char *buf_base;
+	unsigned short buf_tail;
+};
+
+int uring_enter(struct uring *ring, unsigned min_complete)
+{
+	unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	return syscall(__NR_io_uring_enter, ring->ringfd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// get a free submission queue entry, submitting the pending ones first if the queue is full
+// returns NULL on error and errno will be set
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+	{
+		if (uring_enter(ring, 0) < 0 && errno != EINTR)
+		{
+			return NULL;
+		}
+	}
+
+	unsigned index = ring->sq_local_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	return sqe;
+}
+
+// give buffer number bid back to the kernel so it can be used by a future receive
+void uring_recycle_buffer(struct uring *ring, unsigned short bid)
+{
+	struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUF_COUNT - 1)];
+
+	buf->addr = (uint64_t) (uintptr_t) (ring->buf_base + (size_t) bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+// unmap whatever uring_init mapped and close the ring, keeping errno for the caller
+void uring_free(struct uring *ring)
+{
+	int saved_errno = errno;
+
+	if (ring->buf_base != NULL)
+	{
+		munmap(ring->buf_base, (size_t) URING_BUF_COUNT * URING_BUF_SIZE);
+	}
+	if (ring->buf_ring != NULL)
+	{
+		munmap(ring->buf_ring, URING_BUF_COUNT * sizeof(struct io_uring_buf));
+	}
+	if (ring->sqes != NULL)
+	{
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+	{
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring != NULL)
+	{
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	}
+	if (ring->ringfd >= 0)
+	{
+		close(ring->ringfd);
+	}
+	memset(ring, 0, sizeof(*ring));
+	ring->ringfd = -1;
+	errno = saved_errno;
+}
+
+// create the ring, map its queues and register the provided receive buffers
+// returns negative value on error and errno will be set (with nothing left mapped or open), returns 0 otherwise
+int uring_init(struct uring *ring)
+{
+	struct io_uring_params params;
+	struct io_uring_buf_reg buf_reg;
+	size_t sq_size;
+	size_t cq_size;
+	char *sq_ptr;
+	char *cq_ptr;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->ringfd < 0)
+	{
+		ring->ringfd = -1;
+		return -1;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) // both rings share one mapping
+	{
+		sq_size = cq_size = (sq_size > cq_size ? sq_size : cq_size);
+	}
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+	{
+		uring_free(ring);
+		return -1;
+	}
+	ring->sq_ring = sq_ptr;
+	ring->sq_ring_size = sq_size;
+	cq_ptr = sq_ptr;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+		{
+			uring_free(ring);
+			return -1;
+		}
+	}
+	ring->cq_ring = cq_ptr;
+	ring->cq_ring_size = cq_size;
+
+	struct io_uring_sqe *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		uring_free(ring);
+		return -1;
+	}
+	ring->sqes = sqes;
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_head = (unsigned *) (sq_ptr + params.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq_ptr + params.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq_ptr + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq_ptr + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *) (cq_ptr + params.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq_ptr + params.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq_ptr + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq_ptr + params.cq_off.cqes);
+
+	// the buffer ring itself must be page aligned, so it gets its own anonymous mapping
+	void *buf_ring = mmap(NULL, URING_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	void *buf_base = mmap(NULL, (size_t) URING_BUF_COUNT * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ring->buf_ring = buf_ring == MAP_FAILED ? NULL : buf_ring;
+	ring->buf_base = buf_base == MAP_FAILED ? NULL : buf_base;
+	if (ring->buf_ring == NULL || ring->buf_base == NULL)
+	{
+		uring_free(ring);
+		return -1;
+	}
+
+	memset(&buf_reg, 0, sizeof(buf_reg));
+	buf_reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+	buf_reg.ring_entries = URING_BUF_COUNT;
+	buf_reg.bgid = URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->ringfd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0)
+	{
+		uring_free(ring);
+		return -1;
+	}
+
+	for (unsigned bid = 0; bid < URING_BUF_COUNT; bid++)
+	{
+		uring_recycle_buffer(ring, bid);
+	}
+	return 0;
+}
+
+// queue a request of type op for client (NULL for the listening socket) on fd
+// returns NULL on error and errno will be set, returns the queued entry otherwise
+struct io_uring_sqe *uring_queue(struct uring *ring, int op, int fd, struct uring_client *client)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == NULL)
+	{
+		return NULL;
+	}
+
+	sqe->fd = fd;
+	sqe->user_data = (uint64_t) (uintptr_t) client | op;
+
+	switch (op)
+	{
+	case URING_OP_ACCEPT:
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT; // keep accepting until cancelled
+		break;
+	case URING_OP_RECV:
+		sqe->opcode = IORING_OP_RECV;
+		sqe->flags = IOSQE_BUFFER_SELECT; // let the kernel pick one of the provided buffers
+		sqe->buf_group = URING_BUF_GROUP;
+		sqe->len = URING_BUF_SIZE;
+		break;
+	case URING_OP_SEND:
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t) (uintptr_t) ((char *) client->reply + client->sent);
+		sqe->len = client->reply_size - client->sent;
+		sqe->msg_flags = MSG_NOSIGNAL; // a client that went away is reported as EPIPE instead of killing the server
+		break;
+	case URING_OP_CLOSE:
+		sqe->opcode = IORING_OP_CLOSE;
+		break;
+	}
+	return sqe;
+}
+
+// report an error completion of a client request, message describes what we were doing
+// returns 0 for non-fatal (TCP connection) errors, -1 for fatal errors
+int uring_client_error(int res, const char *message)
+{
+	if (res == -ETIMEDOUT || res == -ECONNRESET || res == -EPIPE)
+	{
+		fprintf(stderr, "TCP error in client connection while %s: %s\n", message, strerror(-res));
+		return 0;
+	}
+	fprintf(stderr, "error in %s: %s\n", message, strerror(-res));
+	return -1;
+}
+
+// consume count received bytes of client, first completing N and then counting file data
+void uring_consume(struct uring_client *client, const char *buffer, uint32_t count, int extended)
+{
+	while (count > 0 && client->header_read < sizeof(client->N_network))
+	{
+		((char *) &client->N_network)[client->header_read++] = *buffer++;
+		count--;
+		if (client->header_read == sizeof(client->N_network))
+		{
+			client->remaining = ntohl(client->N_network);
+		}
+	}
+
+	if (client->header_read < sizeof(client->N_network))
+	{
+		return;
+	}
+
+	// bytes the client sent beyond N are ignored just like the blocking engine never reads them
+	if (count > client->remaining)
+	{
+		count = client->remaining;
+	}
+	if (extended)
+	{
+		count_extended(buffer, count, &client->crc, client->byte_total_local);
+	}
+	else
+	{
+		client->C_host += count_printable(buffer, count, client->pcc_total_local);
+	}
+	client->remaining -= count;
+}
+
+// handle one completion, queueing the next request of its client
+// returns negative value on fatal errors (after printing them), 0 otherwise
+int uring_handle(struct uring *ring, struct io_uring_cqe *cqe, uint32_t *pcc_total, uint32_t *byte_total,
+		int *active_clients, int *accepting)
+{
+	int op = cqe->user_data & URING_OP_MASK;
+	struct uring_client *client = (struct uring_client *) (uintptr_t) (cqe->user_data & ~URING_OP_MASK);
+	int res = cqe->res;
+	int next_op = -1;
+
+	switch (op)
+	{
+	case URING_OP_ACCEPT:
+		if (!(cqe->flags & IORING_CQE_F_MORE)) // the multishot accept was terminated and needs re-arming
+		{
+			*accepting = 0;
+		}
+		if (res < 0)
+		{
+			if (res == -ECANCELED || res == -EINTR || (sigint_happened && res == -EINVAL)) // -EINVAL once the listening socket was shut down
+			{
+				return 0;
+			}
+			fprintf(stderr, "accept failed: %s\n", strerror(-res));
+			return -1;
+		}
+
+		client = calloc(1, sizeof(*client));
+		if (client == NULL)
+		{
+			perror("error allocating client");
+			return -1;
+		}
+		client->connfd = res;
+		client->crc = ~0U;
+		(*active_clients)++;
+		next_op = URING_OP_RECV;
+		break;
+
+	case URING_OP_RECV:
+		if (res == -ENOBUFS || res == -EINTR || res == -EAGAIN) // transient, just receive again
+		{
+			next_op = URING_OP_RECV;
+			break;
+		}
+		if (res < 0)
+		{
+			if (uring_client_error(res, client->header_read < sizeof(client->N_network) ? "reading N" : "reading file data") < 0)
+			{
+				return -1;
+			}
+			next_op = URING_OP_CLOSE;
+			break;
+		}
+		if (res == 0) // we didn't read anything while still expecting data, this means unexpectedly closed connection
+		{
+			fprintf(stderr, "client unexpectedly closed connection\n");
+			next_op = URING_OP_CLOSE;
+			break;
+		}
+
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uring_consume(client, ring->buf_base + (size_t) bid * URING_BUF_SIZE, res, byte_total != NULL);
+		uring_recycle_buffer(ring, bid);
+
+		if (client->header_read == sizeof(client->N_network) && client->remaining == 0)
+		{
+			client->reply_size = build_reply(client->reply, client->C_host, client->crc,
+					byte_total != NULL ? client->byte_total_local : NULL, client->pcc_total_local);
+			next_op = URING_OP_SEND;
+		}
+		else
+		{
+			next_op = URING_OP_RECV;
+		}
+		break;
+
+	case URING_OP_SEND:
+		if (res == -EINTR || res == -EAGAIN) // we still need to continue sending
+		{
+			next_op = URING_OP_SEND;
+			break;
+		}
+		if (res < 0)
+		{
+			if (uring_client_error(res, "sending C") < 0)
+			{
+				return -1;
+			}
+			next_op = URING_OP_CLOSE;
+			break;
+		}
+
+		client->sent += res;
+		if (client->sent < client->reply_size) // partial send, send the rest like sendall does
+		{
+			next_op = URING_OP_SEND;
+			break;
+		}
+
+		// update global pcc_total counts
+		for (int i = 0; i < PRINTABLE_COUNT; i++)
+		{
+			pcc_total[i] += client->pcc_total_local[i];
+		}
+		if (byte_total != NULL)
+		{
+			for (int i = 0; i < BYTE_VALUES; i++)
+			{
+				byte_total[i] += client->byte_total_local[i];
+			}
+		}
+		next_op = URING_OP_CLOSE;
+		break;
+
+	case URING_OP_CLOSE:
+		free(client);
+		(*active_clients)--;
+		return 0;
+	}
+
+	if (uring_queue(ring, next_op, client->connfd, client) == NULL)
+	{
+		perror("error queueing io_uring request");
+		return -1;
+	}
+	return 0;
+}
+
+// serve clients on listenfd through io_uring (byte_total is NULL unless in extended mode) until a SIGINT was detected and all started clients were served
+// returns 1 if io_uring is unavailable (nothing was served), -1 for fatal errors (after printing them), 0 otherwise
+int serve_uring(int listenfd, uint32_t *pcc_total, uint32_t *byte_total)
+{
+	struct uring ring;
+	int active_clients = 0;
+	int accepting = 0;
+	int cancel_queued = 0;
+
+	if (uring_init(&ring) < 0)
+	{
+		if (errno == ENOSYS || errno == EPERM || errno == EINVAL) // old or restricted kernel, use the blocking engine
+		{
+			return 1;
+		}
+		perror("error creating io_uring");
+		return -1;
+	}
+
+	while (!sigint_happened || accepting || active_clients > 0)
+	{
+		if (!sigint_happened && !accepting)
+		{
+			if (uring_queue(&ring, URING_OP_ACCEPT, listenfd, NULL) == NULL)
+			{
+				perror("error queueing io_uring request");
+				uring_free(&ring);
+				return -1;
+			}
+			accepting = 1;
+		}
+		else if (sigint_happened && accepting && !cancel_queued) // stop accepting, the clients already accepted are still served
+		{
+			struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+			if (sqe == NULL)
+			{
+				perror("error queueing io_uring request");
+				uring_free(&ring);
+				return -1;
+			}
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->addr = URING_OP_ACCEPT; // user_data of the accept request
+			sqe->user_data = URING_OP_CLOSE; // completion of the cancel itself is ignored below
+			cancel_queued = 1;
+			shutdown(listenfd, SHUT_RD); // refuse new connections now instead of leaving them in the backlog until we exit
+		}
+
+		// submit everything queued by the previous completions and wait for at least one more
+		if (uring_enter(&ring, 1) < 0)
+		{
+			if (errno == EINTR) // if we were interrupted by a signal handler continue to next iteration (stop accepting for SIGINT)
+			{
+				continue;
+			}
+			perror("io_uring_enter failed");
+			uring_free(&ring);
+			return -1;
+		}
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+			if (cqe->user_data == URING_OP_CLOSE) // completion of the accept cancellation
+			{
+				continue;
+			}
+			if (uring_handle(&ring, cqe, pcc_total, byte_total, &active_clients, &accepting) < 0)
+			{
+				uring_free(&ring);
+				return -1;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	uring_free(&ring);
+	return 0;
+}
+#endif
+
 // code partially based on networks and signal recitations code
 int main(int argc, char *argv[])
 {
-	if (argc != 2)
+	int extended = 0; // extended reply mode: CRC32C and full byte histogram are sent after C
+
+	if (argc != 2 && argc != 3)
 	{
 		fprintf(stderr, "wrong number of arguments\n");
 		return 1;
 	}
+	if (argc == 3)
+	{
+		if (strcmp(argv[2], "-x") != 0)
+		{
+			fprintf(stderr, "unknown option %s\n", argv[2]);
+			return 1;
+		}
+		extended = 1;
+		crc32c_init();
+	}
 
 	struct sigaction newAction = {.sa_handler = sigint_handler};
 	if (sigaction(SIGINT, &newAction, NULL) == -1) {
@@ -190,6 +860,7 @@ int main(int argc, char *argv[])
 	int listenfd	= -1;
 	struct sockaddr_in serv_addr;
 	uint32_t pcc_total[PRINTABLE_COUNT] = {0}; // init pcc_total as an array with the needed size filled with zeroes
+	uint32_t byte_total[BYTE_VALUES] = {0}; // counts of every byte value (extended mode)
 	int reuse_addr_value = 1; // value of boolean flag for SO_REUSEADDR
 
 	if( (listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
@@ -224,6 +895,18 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
+#ifdef PCC_IO_URING
+	int uring_status = serve_uring(listenfd, pcc_total, extended ? byte_total : NULL);
+	if (uring_status < 0)
+	{
+		return 1;
+	}
+	if (uring_status > 0)
+	{
+		fprintf(stderr, "io_uring unavailable, using blocking accept loop\n");
+	}
+#endif
+
 	while( !sigint_happened ) // run the server until a SIGINT was detected
 	{
 		int connfd = accept( listenfd, NULL, NULL );
@@ -242,7 +925,7 @@ int main(int argc, char *argv[])
 		}
 
 		// serve the client, updating pcc_total as needed. exit if a fatal error occured (serve_client prints the error message)
-		if (serve_client(connfd, pcc_total) < 0)
+		if (serve_client(connfd, pcc_total, extended ? byte_total : NULL) < 0)
 		{
 			return 1;
 		}
@@ -255,5 +938,13 @@ int main(int argc, char *argv[])
 		printf("char '%c' : %u times\n", c, pcc_total[c - PRINTABLE_START]);
 	}
 
+	if (extended)
+	{
+		for (int i = 0; i < BYTE_VALUES; i++)
+		{
+			printf("byte 0x%02x : %u times\n", i, byte_total[i]);
+		}
+	}
+
 	return 0;
 }